@@ -0,0 +1,277 @@
+/*
+ * Microbenchmarks of the hot paths of the client on synthetic inputs.
+ *
+ * Each primitive is measured on small, medium and huge inputs: request signing,
+ * base64 encoding, form encoding, multipart response splitting, semdoc parsing
+ * with the extraction of the senses, and the decoding of paraphrase.xml responses.
+ * No request is sent: the keys need not be valid.
+ *
+ * Requires the RPMs: mhash-devel curl-devel libxml2-devel google-benchmark-devel
+ *
+ * Compile with:
+ *   g++ -std=c++17 -O2 -DNDEBUG -o client_bench -I /usr/include/libxml2 client_bench.cc -lbenchmark -lpthread -lxml2 -lmhash -lcurl
+ *
+ * Run with:
+ *   ./client_bench --benchmark_out=bench.json --benchmark_out_format=json
+ * The JSON results of two builds can be compared with compare.py of Google Benchmark:
+ *   compare.py benchmarks before.json after.json
+ */
+
+#include "../common/arena.h"
+#include "../common/http.h"
+#include "../common/paraphrases.h"
+#include "../common/response_buffer.h"
+#include "../common/senses.h"
+#include "../common/signature.h"
+#include "../common/xml.h"
+
+#include <benchmark/benchmark.h>
+
+#include <libxml/parser.h>
+
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+
+// Input sizes in bytes, or in elements for the XML documents
+static const int64_t small = 64, medium = 16 << 10, huge = 4 << 20;
+static const int64_t fewElements = 8, someElements = 1000, manyElements = 100000;
+
+
+// Text made of words, with some punctuation and non-ASCII characters
+static string makeText(size_t len)
+{
+  static const char * const words[] = {"jaguar", "jungle", "food", "porch", "lights", "JFK", "Dallas",
+      "montréal", "hockey", "&", "tide", "café", "50%", "a+b", "#tag"};
+  mt19937 rng(len);
+  string text;
+  while (text.length() < len)
+  {
+    text += words[rng() % (sizeof(words) / sizeof(words[0]))];
+    text += ' ';
+  }
+  text.resize(len);
+  return text;
+}
+
+
+// Semdoc with an fs element per word of the text
+static string makeSemdoc(int64_t numWords, string & text)
+{
+  static const char * const words[] = {"jaguar", "jungle", "food", "porch", "lights", "hockey", "tide", "bank"};
+  mt19937 rng(numWords);
+  string doc = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<semdoc><sentence>";
+  text.clear();
+  for (int64_t i = 0; i < numWords; ++i)
+  {
+    const char * w = words[rng() % (sizeof(words) / sizeof(words[0]))];
+    text += w;
+    text += ' ';
+    doc += "<fs sk=\"";
+    doc += w;
+    doc += "/N" + to_string(1 + rng() % 3) + "\" fsk=\"" + w + "/N1\"><w>" + w + "</w></fs>\n";
+  }
+  doc += "</sentence></semdoc>";
+  return doc;
+}
+
+
+// paraphrase.xml response with the given number of paraphrases
+static string makeParaphrases(int64_t num)
+{
+  string doc = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<paraphraseResponse>"
+      "<queryConf><confCorrectFineMostProbable>0.87</confCorrectFineMostProbable></queryConf><paraphrases>";
+  for (int64_t i = 0; i < num; ++i)
+    doc += "<paraphrase><surface>porch lamp " + to_string(i) + "</surface><weight>0." + to_string(i % 100) + "</weight></paraphrase>\n";
+  doc += "</paraphrases></paraphraseResponse>";
+  return doc;
+}
+
+
+// Fill a response buffer as curl would, in chunks of 16KB
+static void fill(idilia::ResponseBuffer & buf, const string & content)
+{
+  for (size_t pos = 0; pos < content.length(); pos += 16 << 10)
+    buf.append(content.data() + pos, min(content.length() - pos, size_t(16 << 10)));
+}
+
+
+static void BM_EncodeBase64(benchmark::State & state)
+{
+  string bytes = makeText(state.range(0));
+  idilia::Arena arena;
+  for (auto _ : state)
+  {
+    benchmark::DoNotOptimize(idilia::encodeBase64(arena, (const unsigned char *)bytes.data(), bytes.length()));
+    arena.release();
+  }
+  state.SetBytesProcessed(state.iterations() * bytes.length());
+}
+BENCHMARK(BM_EncodeBase64)->Arg(small)->Arg(medium)->Arg(huge);
+
+
+static void BM_AddSignature(benchmark::State & state)
+{
+  string text = makeText(state.range(0));
+  idilia::Arena arena;
+  for (auto _ : state)
+  {
+    benchmark::DoNotOptimize(idilia::addSignature(arena, "api.idilia.com", "/1/text/disambiguate.xml", text.data(), text.length(), 0));
+    arena.release();
+  }
+  state.SetBytesProcessed(state.iterations() * text.length());
+}
+BENCHMARK(BM_AddSignature)->Arg(small)->Arg(medium)->Arg(huge);
+
+
+static void BM_ConvertToQueryParms(benchmark::State & state)
+{
+  string text = makeText(state.range(0));
+  idilia::Arena arena;
+  for (auto _ : state)
+  {
+    idilia::RequestParms parms(arena);
+    parms["requestId"] = "my-request";
+    parms["text"] = text;
+    parms["textMime"] = "text/plain; charset=UTF-8";
+    benchmark::DoNotOptimize(idilia::convertToQueryParms(arena, parms));
+    arena.release();
+  }
+  state.SetBytesProcessed(state.iterations() * text.length());
+}
+BENCHMARK(BM_ConvertToQueryParms)->Arg(small)->Arg(medium)->Arg(huge);
+
+
+// Multipart response of mpxml: a small status part and a semdoc part of the given size
+static void BM_MultipartParse(benchmark::State & state)
+{
+  string text;
+  string semdoc = makeSemdoc(1, text);
+  semdoc.resize(state.range(0), ' ');
+  string content = "--BNDxyz\r\nContent-Type: text/xml\r\n\r\n"
+      "<?xml version=\"1.0\"?><response><status>200</status><requestId>my-request</requestId></response>"
+      "\r\n--BNDxyz\r\nContent-Type: application/x-semdoc+xml\r\nContent-Length: " + to_string(semdoc.length()) +
+      "\r\n\r\n" + semdoc + "\r\n--BNDxyz--";
+
+  idilia::Arena bufArena;
+  idilia::ResponseBuffer buf(bufArena);
+  fill(buf, content);
+  idilia::RopeView body = buf.view();
+
+  idilia::Arena arena;
+  for (auto _ : state)
+  {
+    {
+      idilia::MultipartHttpResponse response(arena);
+      if (!response.parse(body) || response.parts.size() != 2)
+      {
+        state.SkipWithError("Could not parse the multipart response");
+        break;
+      }
+      benchmark::DoNotOptimize(response.parts.data());
+    }
+    arena.release();
+  }
+  state.SetBytesProcessed(state.iterations() * content.length());
+}
+BENCHMARK(BM_MultipartParse)->Arg(small)->Arg(medium)->Arg(huge);
+
+
+// Parse a semdoc and extract its senses with XPath as match_local and semdoc_store do
+static void BM_SemdocExtract(benchmark::State & state)
+{
+  string text;
+  string semdoc = makeSemdoc(state.range(0), text);
+  idilia::Arena bufArena;
+  idilia::ResponseBuffer buf(bufArena);
+  fill(buf, semdoc);
+
+  idilia::SenseKeyDictionary dict;
+  idilia::CompactSenses senses;
+  idilia::Arena arena;
+  for (auto _ : state)
+  {
+    {
+      idilia::XmlArenaScope xmlScope(arena);
+      xmlDocPtr doc = idilia::readXmlDoc(buf.view());
+      if (!doc)
+      {
+        state.SkipWithError("Could not parse the semdoc");
+        break;
+      }
+      idilia::extractSenses(doc, text, dict, senses);
+      xmlFreeDoc(doc);
+    }
+    arena.release();
+    if (senses.size() != (size_t)state.range(0))
+    {
+      state.SkipWithError("Senses missing");
+      break;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * semdoc.length());
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SemdocExtract)->Arg(fewElements)->Arg(someElements)->Arg(manyElements)->Unit(benchmark::kMicrosecond);
+
+
+// Decode a paraphrase.xml response with the decoder of paraphrase_xml
+static void BM_ParaphraseDecode(benchmark::State & state)
+{
+  string content = makeParaphrases(state.range(0));
+  idilia::Arena bufArena;
+  idilia::ResponseBuffer buf(bufArena);
+  fill(buf, content);
+
+  idilia::Arena arena;
+  idilia::Paraphrases paraphrases;
+  for (auto _ : state)
+  {
+    {
+      idilia::XmlArenaScope xmlScope(arena);
+      xmlDocPtr doc = idilia::readXmlDoc(buf.view());
+      if (!doc)
+      {
+        state.SkipWithError("Could not parse the paraphrases");
+        break;
+      }
+      idilia::decodeParaphrases(doc, paraphrases);
+      xmlFreeDoc(doc);
+    }
+    arena.release();
+    if (paraphrases.paraphrases.size() != (size_t)state.range(0))
+    {
+      state.SkipWithError("Paraphrases missing");
+      break;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * content.length());
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ParaphraseDecode)->Arg(fewElements)->Arg(someElements)->Arg(manyElements)->Unit(benchmark::kMicrosecond);
+
+
+int main(int argc, char **argv)
+{
+  // Signing needs keys but nothing is sent
+  setenv("IDILIA_ACCESS_KEY", "benchmark", 0);
+  setenv("IDILIA_PRIVATE_KEY", "benchmark", 0);
+
+  // Global initializations to do only once
+  idilia::installXmlArenaHooks();
+  LIBXML_TEST_VERSION;
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    return 1;
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+
+  // Global cleanup done once
+  xmlCleanupParser();
+  return 0;
+}
@@ -0,0 +1,310 @@
+/*
+ * Arena allocator for the short-lived objects of a request.
+ *
+ * A request creates many small objects: the parameters and their encoding,
+ * the signature, the headers, the response buffer and the parsed results.
+ * Allocating them from an Arena avoids contention on the global allocator
+ * and releases them all at once when the request (or batch) is done.
+ *
+ * libxml2 can also be made to allocate from the arena with installXmlArenaHooks()
+ * and XmlArenaScope.
+ */
+
+#ifndef IDILIA_ARENA_H
+#define IDILIA_ARENA_H
+
+#include <libxml/xmlmemory.h>
+#include <libxml/parser.h>
+#include <libxml/xmlerror.h>
+
+#include <curl/curl.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <map>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace idilia {
+
+
+// Bump allocator over a chain of blocks.
+// Individual deallocations are no-ops; memory is reclaimed by release() or on destruction.
+// Not thread safe: use one arena per thread or per request.
+class Arena
+{
+public:
+  explicit Arena(size_t blockSz = 64 << 10) : blockSz_(blockSz), head_(0), cur_(0), end_(0), used_(0) {}
+  ~Arena()
+  {
+    freeBlocks(head_);
+  }
+
+  Arena(const Arena &) = delete;
+  Arena & operator=(const Arena &) = delete;
+
+  void * allocate(size_t sz, size_t align = alignof(std::max_align_t))
+  {
+    char * p = (char *)(((uintptr_t)cur_ + align - 1) & ~(uintptr_t)(align - 1));
+    if (p + sz > end_ || !cur_)
+    {
+      newBlock(sz + align);
+      p = (char *)(((uintptr_t)cur_ + align - 1) & ~(uintptr_t)(align - 1));
+    }
+    cur_ = p + sz;
+    used_ += sz;
+    return p;
+  }
+
+  // Copy a string in the arena. The result is nul-terminated.
+  char * strdup(const char * s, size_t len)
+  {
+    char * p = (char *)allocate(len + 1, 1);
+    memcpy(p, s, len);
+    p[len] = 0;
+    return p;
+  }
+
+  // Concatenate strings in the arena. The result is nul-terminated.
+  std::string_view concat(std::initializer_list<std::string_view> parts)
+  {
+    size_t len = 0;
+    for (std::string_view s : parts)
+      len += s.length();
+    char * p = (char *)allocate(len + 1, 1);
+    char * o = p;
+    for (std::string_view s : parts)
+    {
+      memcpy(o, s.data(), s.length());
+      o += s.length();
+    }
+    *o = 0;
+    return std::string_view(p, len);
+  }
+
+  // Release everything allocated in one shot.
+  // The first block is kept to serve the next request without calling malloc.
+  void release()
+  {
+    if (!head_)
+      return;
+    freeBlocks(head_->next);
+    head_->next = 0;
+    cur_ = head_->data();
+    end_ = (char *)head_ + head_->size;
+    used_ = 0;
+  }
+
+  // Number of bytes handed out since the last release
+  size_t bytesUsed() const { return used_; }
+
+private:
+  struct Block
+  {
+    Block * next;
+    size_t size;
+    char * data() { return (char *)(this + 1); }
+  };
+
+  void newBlock(size_t minSz)
+  {
+    size_t sz = sizeof(Block) + (minSz > blockSz_ ? minSz : blockSz_);
+    Block * b = (Block *)malloc(sz);
+    if (!b)
+      throw std::bad_alloc();
+    b->size = sz;
+    // Keep the head block first so that release() retains it
+    if (head_)
+    {
+      b->next = head_->next;
+      head_->next = b;
+    }
+    else
+    {
+      b->next = 0;
+      head_ = b;
+    }
+    cur_ = b->data();
+    end_ = (char *)b + sz;
+  }
+
+  static void freeBlocks(Block * b)
+  {
+    while (b)
+    {
+      Block * next = b->next;
+      free(b);
+      b = next;
+    }
+  }
+
+  size_t blockSz_;
+  Block * head_;
+  char * cur_;
+  char * end_;
+  size_t used_;
+};
+
+
+// Standard allocator adaptor for using the containers of the standard library in an Arena
+template <class T>
+struct ArenaAllocator
+{
+  typedef T value_type;
+
+  ArenaAllocator(Arena & a) : arena(&a) {}
+  template <class U> ArenaAllocator(const ArenaAllocator<U> & o) : arena(o.arena) {}
+
+  T * allocate(size_t n) { return (T *)arena->allocate(n * sizeof(T), alignof(T)); }
+  void deallocate(T *, size_t) {}
+
+  template <class U> bool operator==(const ArenaAllocator<U> & o) const { return arena == o.arena; }
+  template <class U> bool operator!=(const ArenaAllocator<U> & o) const { return arena != o.arena; }
+
+  Arena * arena;
+};
+
+typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char> > ArenaString;
+
+template <class T>
+using ArenaVector = std::vector<T, ArenaAllocator<T> >;
+
+template <class K, class V>
+using ArenaMap = std::map<K, V, std::less<K>, ArenaAllocator<std::pair<const K, V> > >;
+
+
+// Append the header made of the concatenation of parts to a curl list.
+// The node and its string are in the arena: a list built this way must only be
+// extended with this function and must not be freed with curl_slist_free_all.
+inline curl_slist * arenaSlistAppend(Arena & arena, curl_slist * list, std::initializer_list<std::string_view> parts)
+{
+  curl_slist * node = (curl_slist *)arena.allocate(sizeof(curl_slist), alignof(curl_slist));
+  node->data = const_cast<char *>(arena.concat(parts).data());
+  node->next = 0;
+  if (!list)
+    return node;
+  curl_slist * last = list;
+  while (last->next)
+    last = last->next;
+  last->next = node;
+  return list;
+}
+
+
+//
+// libxml2 allocation hooks.
+//
+// Every block handed to libxml2 is preceded by a header recording whether it comes
+// from an arena so that xmlFree knows whether to release it. Blocks are allocated
+// from the arena of the innermost XmlArenaScope of the calling thread, or
+// from the heap when there is none.
+
+struct XmlBlockHeader
+{
+  size_t size;
+  size_t inArena;
+};
+static_assert(sizeof(XmlBlockHeader) % alignof(std::max_align_t) == 0, "header breaks alignment");
+
+inline Arena *& currentXmlArena()
+{
+  static thread_local Arena * arena = 0;
+  return arena;
+}
+
+inline void * xmlArenaMalloc(size_t sz)
+{
+  XmlBlockHeader * hdr;
+  Arena * arena = currentXmlArena();
+  if (arena)
+    hdr = (XmlBlockHeader *)arena->allocate(sizeof(XmlBlockHeader) + sz);
+  else if (!(hdr = (XmlBlockHeader *)malloc(sizeof(XmlBlockHeader) + sz)))
+    return 0;
+  hdr->size = sz;
+  hdr->inArena = arena != 0;
+  return hdr + 1;
+}
+
+inline void xmlArenaFree(void * p)
+{
+  if (!p)
+    return;
+  XmlBlockHeader * hdr = (XmlBlockHeader *)p - 1;
+  if (!hdr->inArena)
+    free(hdr);
+}
+
+inline void * xmlArenaRealloc(void * p, size_t sz)
+{
+  if (!p)
+    return xmlArenaMalloc(sz);
+  XmlBlockHeader * hdr = (XmlBlockHeader *)p - 1;
+  if (!hdr->inArena)
+  {
+    hdr = (XmlBlockHeader *)realloc(hdr, sizeof(XmlBlockHeader) + sz);
+    if (!hdr)
+      return 0;
+    hdr->size = sz;
+    return hdr + 1;
+  }
+  if (sz <= hdr->size)
+    return p;
+  void * np = xmlArenaMalloc(sz);
+  if (np)
+    memcpy(np, p, hdr->size);
+  return np;
+}
+
+inline char * xmlArenaStrdup(const char * s)
+{
+  size_t len = strlen(s) + 1;
+  char * p = (char *)xmlArenaMalloc(len);
+  if (p)
+    memcpy(p, s, len);
+  return p;
+}
+
+// Install the hooks. Must be called before any other libxml2 function.
+inline void installXmlArenaHooks()
+{
+  if (xmlMemSetup(xmlArenaFree, xmlArenaMalloc, xmlArenaRealloc, xmlArenaStrdup) != 0)
+    throw std::runtime_error("Could not install libxml2 memory hooks");
+  // Allocate the process wide state of the library on the heap
+  xmlInitParser();
+}
+
+
+// Directs the libxml2 allocations of the calling thread to an arena for the lifetime of the scope.
+// Every libxml2 object created in the scope must be freed or abandoned before
+// the arena is released.
+struct XmlArenaScope
+{
+  XmlArenaScope(Arena & arena) : prev_(currentXmlArena())
+  {
+    // Ensures that the per-thread state of libxml2 exists and is on the heap
+    xmlResetLastError();
+    currentXmlArena() = &arena;
+  }
+  ~XmlArenaScope()
+  {
+    // The last error may reference strings in the arena
+    xmlResetLastError();
+    currentXmlArena() = prev_;
+  }
+
+  XmlArenaScope(const XmlArenaScope &) = delete;
+  XmlArenaScope & operator=(const XmlArenaScope &) = delete;
+
+private:
+  Arena * prev_;
+};
+
+} // namespace idilia
+
+#endif // IDILIA_ARENA_H
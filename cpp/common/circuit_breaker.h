@@ -0,0 +1,250 @@
+/*
+ * Circuit breakers failing the requests to a degraded endpoint fast instead of
+ * queuing them behind requests that time out.
+ *
+ * A breaker is closed while the endpoint is healthy. It opens when, over a recent
+ * window, too many requests failed or were slow; while open, requests are failed
+ * without being sent. After a delay it lets a few probe requests through (half
+ * open): it closes if they succeed and opens again if one fails.
+ *
+ * The AsyncTransport admits the requests that have a breaker and reports their
+ * outcome to it.
+ */
+
+#ifndef IDILIA_CIRCUIT_BREAKER_H
+#define IDILIA_CIRCUIT_BREAKER_H
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace idilia {
+
+
+// Thrown for a request failed fast because the breaker of its endpoint is open
+class CircuitOpenError : public std::runtime_error
+{
+public:
+  explicit CircuitOpenError(std::string_view endpoint) :
+    std::runtime_error("Circuit open for " + std::string(endpoint)) {}
+};
+
+
+struct CircuitBreakerOptions
+{
+  std::chrono::milliseconds window{10000};   // outcomes considered to open
+  size_t minRequests = 20;                   // in the window before the breaker may open
+  double maxErrorRate = 0.5;                 // of requests not performed or answered 5xx or 429
+  std::chrono::milliseconds slowCall{5000};  // latency over which a request is slow
+  double maxSlowRate = 0.8;                  // of slow requests
+  unsigned timeoutSlowCalls = 4;             // slowCall periods after which a request fails
+  std::chrono::milliseconds openFor{5000};   // before probing
+  unsigned maxProbes = 2;                    // requests in progress while half open
+  unsigned probesToClose = 3;                // successful probes to close
+};
+
+
+class CircuitBreaker
+{
+public:
+  typedef std::chrono::steady_clock Clock;
+  enum State { closed, open, halfOpen };
+  enum Decision { admitted, probe, rejected };
+
+  // Whether a request may be sent, stamped with the generation of the breaker: the number
+  // of times it opened. Outcomes of requests admitted before it last opened are ignored.
+  struct Admission
+  {
+    Admission(Decision d = admitted, uint64_t g = 0) : decision(d), generation(g) {}
+    bool operator==(Decision d) const { return decision == d; }
+    bool operator!=(Decision d) const { return decision != d; }
+
+    Decision decision;
+    uint64_t generation;
+  };
+
+  explicit CircuitBreaker(const CircuitBreakerOptions & options = CircuitBreakerOptions()) :
+    options_(options), state_(closed), numProbes_(0), numProbesOk_(0), numTrips_(0), numRejected_(0)
+  {
+    resetWindow();
+  }
+
+  CircuitBreaker(const CircuitBreaker &) = delete;
+  CircuitBreaker & operator=(const CircuitBreaker &) = delete;
+
+  // Whether a request may be sent. An admitted request must be reported with record or cancel.
+  Admission admit()
+  {
+    Clock::time_point now = Clock::now();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (state_ == open && now >= openUntil_)
+    {
+      state_ = halfOpen;
+      numProbes_ = numProbesOk_ = 0;
+    }
+    if (state_ == closed)
+      return Admission(admitted, numTrips_);
+    if (state_ == halfOpen && numProbes_ < options_.maxProbes)
+    {
+      ++numProbes_;
+      return Admission(probe, numTrips_);
+    }
+    ++numRejected_;
+    return Admission(rejected, numTrips_);
+  }
+
+  // The outcome of an admitted request
+  void record(Admission admission, bool ok, std::chrono::microseconds latency)
+  {
+    bool slow = latency > options_.slowCall;
+    Clock::time_point now = Clock::now();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (admission.generation != numTrips_)
+      return;
+    if (admission == probe)
+    {
+      if (state_ != halfOpen || numProbes_ == 0)
+        return;
+      --numProbes_;
+      if (!ok || slow)
+        trip(now);
+      else if (++numProbesOk_ >= options_.probesToClose)
+      {
+        state_ = closed;
+        resetWindow();
+      }
+      return;
+    }
+
+    // Late outcomes of requests admitted before the breaker opened are ignored
+    if (admission != admitted || state_ != closed)
+      return;
+    Bucket & b = bucket(now);
+    b.numRequests += 1;
+    b.numErrors += !ok;
+    b.numSlow += slow;
+
+    size_t numRequests = 0, numErrors = 0, numSlow = 0;
+    for (size_t i = 0; i < numBuckets; ++i)
+    {
+      if (now - buckets_[i].start >= options_.window)
+        continue;
+      numRequests += buckets_[i].numRequests;
+      numErrors += buckets_[i].numErrors;
+      numSlow += buckets_[i].numSlow;
+    }
+    if (numRequests >= options_.minRequests &&
+        (numErrors >= options_.maxErrorRate * numRequests || numSlow >= options_.maxSlowRate * numRequests))
+      trip(now);
+  }
+
+  // An admitted request abandoned without an outcome, e.g. when the transport stops
+  void cancel(Admission admission)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (admission == probe && admission.generation == numTrips_ && state_ == halfOpen && numProbes_ > 0)
+      --numProbes_;
+  }
+
+  State state() const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return state_ == open && Clock::now() >= openUntil_ ? halfOpen : state_;
+  }
+
+  // The time after which a request is abandoned and counted as failed, so that the
+  // requests to an endpoint that hangs have an outcome
+  std::chrono::milliseconds timeout() const { return options_.slowCall * options_.timeoutSlowCalls; }
+
+  // Number of times the breaker opened and of requests failed fast
+  uint64_t numTrips() const { std::lock_guard<std::mutex> lock(mutex_); return numTrips_; }
+  uint64_t numRejected() const { std::lock_guard<std::mutex> lock(mutex_); return numRejected_; }
+
+private:
+  static constexpr size_t numBuckets = 10;
+
+  // Outcomes during a tenth of the window
+  struct Bucket
+  {
+    Clock::time_point start;
+    uint32_t numRequests, numErrors, numSlow;
+  };
+
+  Bucket & bucket(Clock::time_point now)
+  {
+    Clock::duration width = options_.window / numBuckets;
+    if (width.count() <= 0)
+      width = Clock::duration(1);
+    int64_t n = now.time_since_epoch() / width;
+    Bucket & b = buckets_[n % numBuckets];
+    Clock::time_point start(n * width);
+    if (b.start != start)
+      b = Bucket{start, 0, 0, 0};
+    return b;
+  }
+
+  void resetWindow()
+  {
+    for (size_t i = 0; i < numBuckets; ++i)
+      buckets_[i] = Bucket{Clock::time_point(), 0, 0, 0};
+  }
+
+  void trip(Clock::time_point now)
+  {
+    state_ = open;
+    openUntil_ = now + options_.openFor;
+    ++numTrips_;
+    resetWindow();
+  }
+
+  const CircuitBreakerOptions options_;
+  mutable std::mutex mutex_;
+  State state_;                  // protected by mutex_
+  Clock::time_point openUntil_;  // protected by mutex_
+  unsigned numProbes_;           // in progress. protected by mutex_
+  unsigned numProbesOk_;         // protected by mutex_
+  Bucket buckets_[numBuckets];   // protected by mutex_
+  uint64_t numTrips_;            // the generation. protected by mutex_
+  uint64_t numRejected_;         // protected by mutex_
+};
+
+
+// The breakers of the endpoints, created on first use
+class CircuitBreakers
+{
+public:
+  explicit CircuitBreakers(const CircuitBreakerOptions & options = CircuitBreakerOptions()) : options_(options) {}
+
+  // The breaker of an endpoint such as /1/text/disambiguate.xml. Valid as long as this object.
+  CircuitBreaker & forEndpoint(std::string_view resource)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unique_ptr<CircuitBreaker> & b = breakers_[std::string(resource)];
+    if (!b)
+      b.reset(new CircuitBreaker(options_));
+    return *b;
+  }
+
+  // Call f(resource, breaker) for each endpoint used
+  template <typename F>
+  void forEach(F f)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto & e : breakers_)
+      f(e.first, *e.second);
+  }
+
+private:
+  const CircuitBreakerOptions options_;
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::unique_ptr<CircuitBreaker> > breakers_; // protected by mutex_
+};
+
+} // namespace idilia
+
+#endif // IDILIA_CIRCUIT_BREAKER_H
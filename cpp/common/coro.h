@@ -0,0 +1,333 @@
+/*
+ * Coroutine tasks and a small executor to run them (C++20).
+ *
+ * Task<T> is a lazily started coroutine returning T: it runs when awaited and
+ * resumes its awaiter when done, propagating exceptions. Top level tasks are
+ * started with Executor::spawn. The executor resumes the coroutines on a few
+ * threads; a coroutine waiting for I/O holds no thread. A Semaphore bounds the
+ * number of tasks in progress, and so their memory.
+ *
+ * Compile with -std=c++20.
+ */
+
+#ifndef IDILIA_CORO_H
+#define IDILIA_CORO_H
+
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace idilia {
+
+
+template <class T> class Task;
+
+namespace coro_detail {
+
+// Resumes the awaiter of a task when the task completes
+struct FinalAwaiter
+{
+  bool await_ready() noexcept { return false; }
+  template <class P>
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+  {
+    std::coroutine_handle<> cont = h.promise().continuation;
+    return cont ? cont : std::noop_coroutine();
+  }
+  void await_resume() noexcept {}
+};
+
+struct PromiseBase
+{
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  FinalAwaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() { error = std::current_exception(); }
+
+  std::coroutine_handle<> continuation;
+  std::exception_ptr error;
+};
+
+template <class T>
+struct Promise : PromiseBase
+{
+  Task<T> get_return_object();
+  template <class U>
+  void return_value(U && v) { value.emplace(std::forward<U>(v)); }
+
+  T result()
+  {
+    if (error)
+      std::rethrow_exception(error);
+    return std::move(*value);
+  }
+
+  std::optional<T> value;
+};
+
+template <>
+struct Promise<void> : PromiseBase
+{
+  Task<void> get_return_object();
+  void return_void() {}
+
+  void result()
+  {
+    if (error)
+      std::rethrow_exception(error);
+  }
+};
+
+} // namespace coro_detail
+
+
+template <class T = void>
+class [[nodiscard]] Task
+{
+public:
+  typedef coro_detail::Promise<T> promise_type;
+  typedef std::coroutine_handle<promise_type> Handle;
+
+  Task(Task && o) noexcept : h_(std::exchange(o.h_, {})) {}
+  Task & operator=(Task && o) noexcept
+  {
+    std::swap(h_, o.h_);
+    return *this;
+  }
+  ~Task()
+  {
+    if (h_)
+      h_.destroy();
+  }
+
+  // Awaiting starts the task; the awaiter resumes with its result when it completes
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+  {
+    h_.promise().continuation = awaiter;
+    return h_;
+  }
+  T await_resume() { return h_.promise().result(); }
+
+private:
+  friend struct coro_detail::Promise<T>;
+  explicit Task(Handle h) : h_(h) {}
+
+  Handle h_;
+};
+
+namespace coro_detail {
+
+template <class T>
+inline Task<T> Promise<T>::get_return_object()
+{
+  return Task<T>(std::coroutine_handle<Promise<T> >::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object()
+{
+  return Task<void>(std::coroutine_handle<Promise<void> >::from_promise(*this));
+}
+
+// A started coroutine that destroys itself when done
+struct Detached
+{
+  struct promise_type
+  {
+    Detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+} // namespace coro_detail
+
+
+// Runs the coroutines ready to resume on a fixed number of threads
+class Executor
+{
+public:
+  explicit Executor(unsigned numThreads = 2) : stop_(false), numSpawned_(0)
+  {
+    for (unsigned i = 0; i < (numThreads ? numThreads : 1); ++i)
+      threads_.emplace_back(&Executor::loop, this);
+  }
+
+  // The spawned tasks must have completed (see wait)
+  ~Executor()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    readyCv_.notify_all();
+    for (size_t i = 0; i < threads_.size(); ++i)
+      threads_[i].join();
+  }
+
+  Executor(const Executor &) = delete;
+  Executor & operator=(const Executor &) = delete;
+
+  // Queue a coroutine to resume. Thread safe.
+  void post(std::coroutine_handle<> h)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ready_.push_back(h);
+    }
+    readyCv_.notify_one();
+  }
+
+  // Awaitable moving the awaiter to one of the executor's threads
+  auto schedule()
+  {
+    struct Awaiter
+    {
+      Executor & ex;
+      bool await_ready() const noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> h) { ex.post(h); }
+      void await_resume() const noexcept {}
+    };
+    return Awaiter{*this};
+  }
+
+  // Start a task on the executor. An exception escaping the task is reported on std::cerr.
+  void spawn(Task<void> task)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++numSpawned_;
+    }
+    runDetached(std::move(task));
+  }
+
+  // Wait until all the spawned tasks have completed
+  void wait()
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    doneCv_.wait(lock, [this] { return numSpawned_ == 0; });
+  }
+
+private:
+  coro_detail::Detached runDetached(Task<void> task)
+  {
+    co_await schedule();
+    try
+    {
+      co_await task;
+    }
+    catch (const std::exception & e)
+    {
+      std::cerr << "Task failed: " << e.what() << std::endl;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--numSpawned_ == 0)
+      doneCv_.notify_all();
+  }
+
+  void loop()
+  {
+    for (;;)
+    {
+      std::coroutine_handle<> h;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        readyCv_.wait(lock, [this] { return stop_ || !ready_.empty(); });
+        if (ready_.empty())
+          return;
+        h = ready_.front();
+        ready_.pop_front();
+      }
+      h.resume();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable readyCv_;
+  std::condition_variable doneCv_;
+  bool stop_;                              // protected by mutex_
+  std::deque<std::coroutine_handle<> > ready_; // protected by mutex_
+  size_t numSpawned_;                      // protected by mutex_
+  std::vector<std::thread> threads_;
+};
+
+
+// Counting semaphore. Coroutines wait for a permit with co_await acquire() and are
+// resumed on the executor; other threads, such as one spawning tasks, wait with
+// acquireBlocking(). Each permit is returned with release().
+class Semaphore
+{
+public:
+  // The executor must outlive the semaphore
+  Semaphore(Executor & executor, size_t count) : executor_(executor), count_(count) {}
+
+  Semaphore(const Semaphore &) = delete;
+  Semaphore & operator=(const Semaphore &) = delete;
+
+  auto acquire()
+  {
+    struct Awaiter
+    {
+      Semaphore & sem;
+      bool await_ready() const noexcept { return false; }
+      bool await_suspend(std::coroutine_handle<> h)
+      {
+        std::lock_guard<std::mutex> lock(sem.mutex_);
+        if (sem.count_ > 0)
+        {
+          --sem.count_;
+          return false; // continue without suspending
+        }
+        sem.waiters_.push_back(h);
+        return true;
+      }
+      void await_resume() const noexcept {}
+    };
+    return Awaiter{*this};
+  }
+
+  void acquireBlocking()
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return count_ > 0; });
+    --count_;
+  }
+
+  // Hand the permit to a waiting coroutine, else to a waiting thread
+  void release()
+  {
+    std::coroutine_handle<> h;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (waiters_.empty())
+      {
+        ++count_;
+        cv_.notify_one();
+        return;
+      }
+      h = waiters_.front();
+      waiters_.pop_front();
+    }
+    executor_.post(h);
+  }
+
+private:
+  Executor & executor_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  size_t count_;                                  // protected by mutex_
+  std::deque<std::coroutine_handle<> > waiters_;  // protected by mutex_
+};
+
+} // namespace idilia
+
+#endif // IDILIA_CORO_H
@@ -0,0 +1,211 @@
+/*
+ * Coroutine front end to the text and kb services (C++20).
+ *
+ *   std::string semdoc = co_await client.disambiguate(text);
+ *
+ * The requests run on the non-blocking AsyncTransport. The awaiting coroutine is
+ * suspended while its request is in progress and is resumed on the executor with
+ * the body of the response, so thousands of calls can be in flight on a few threads.
+ * A failed request throws std::runtime_error at the co_await.
+ *
+ * With protect(), each endpoint has a circuit breaker: while the endpoint is
+ * failing, calls throw CircuitOpenError at once instead of waiting on it, or
+ * resume with the last response to the same request when a cache is given.
+ */
+
+#ifndef IDILIA_CORO_CLIENT_H
+#define IDILIA_CORO_CLIENT_H
+
+#include "circuit_breaker.h"
+#include "coro.h"
+#include "endpoints.h"
+#include "lru_cache.h"
+#include "transport.h"
+
+#include <curl/curl.h>
+
+#include <coroutine>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace idilia {
+
+
+// Bytes of a cached response and of the two copies of its key
+struct ResponseBytes
+{
+  size_t operator()(const std::string & key, const std::string & response) const
+  {
+    return 2 * key.length() + response.length();
+  }
+};
+
+// Successful responses by endpoint and request body, with a capacity in bytes
+typedef LruCache<std::string, std::string, std::hash<std::string>, ResponseBytes> ResponseCache;
+
+
+// Awaitable for a prepared request. Resumes with the body of the response.
+// With a cache, a successful response is stored under key and served from there if the request is failed fast.
+class ServiceCall
+{
+public:
+  ServiceCall(AsyncTransport & transport, Executor & executor, std::unique_ptr<AsyncRequest> req,
+      std::string_view endpoint, ResponseCache * cache = 0, std::string key = std::string()) :
+    transport_(transport), executor_(executor), req_(std::move(req)), endpoint_(endpoint), cache_(cache),
+    key_(std::move(key)), cc_(CURLE_OK), httpCode_(0), rejected_(false) {}
+
+  bool await_ready() const noexcept { return false; }
+
+  void await_suspend(std::coroutine_handle<> h)
+  {
+    // Runs on the transport's thread: only copy the result and hand the coroutine back to the executor
+    req_->onDone = [this, h](AsyncRequest & req, CURLcode cc, long httpCode) {
+      cc_ = cc;
+      httpCode_ = httpCode;
+      rejected_ = req.admission == CircuitBreaker::rejected;
+      body_ = req.response.str();
+      executor_.post(h);
+    };
+    transport_.submit(std::move(req_));
+  }
+
+  std::string await_resume()
+  {
+    if (rejected_)
+    {
+      ResponseCache::ValuePtr stale = cache_ ? cache_->get(key_) : ResponseCache::ValuePtr();
+      if (!stale)
+        throw CircuitOpenError(endpoint_);
+      return *stale;
+    }
+    if (cc_ != CURLE_OK)
+      throw std::runtime_error(curl_easy_strerror(cc_));
+    if (httpCode_ != 200)
+    {
+      std::stringstream ss; ss << httpCode_ << ' ' << body_;
+      throw std::runtime_error(ss.str());
+    }
+    if (cache_)
+      cache_->put(key_, std::make_shared<const std::string>(body_));
+    return std::move(body_);
+  }
+
+private:
+  AsyncTransport & transport_;
+  Executor & executor_;
+  std::unique_ptr<AsyncRequest> req_;
+  std::string_view endpoint_;
+  ResponseCache * cache_;
+  std::string key_;
+  CURLcode cc_;
+  long httpCode_;
+  bool rejected_;
+  std::string body_;
+};
+
+
+class CoroClient
+{
+public:
+  // The executor must outlive the client
+  CoroClient(Executor & executor, unsigned maxConcurrent = 16) :
+    executor_(executor), breakers_(0), staleCache_(0), transport_(maxConcurrent) {}
+
+  AsyncTransport & transport() { return transport_; }
+
+  // Fail the calls fast while their endpoint's breaker is open. With a cache, the
+  // successful responses are kept and a call failed fast resumes with the response
+  // to the same request, however old, if there is one. The calls time out after the
+  // timeout of their breaker so that an endpoint that hangs trips it.
+  // Both must outlive the client. Call before making calls.
+  void protect(CircuitBreakers & breakers, ResponseCache * staleCache = 0)
+  {
+    breakers_ = &breakers;
+    staleCache_ = staleCache;
+  }
+
+  // The semdoc of a text
+  ServiceCall disambiguate(std::string_view text, std::string_view textMime = "text/plain; charset=UTF-8")
+  {
+    std::unique_ptr<AsyncRequest> req(new AsyncRequest);
+    EndpointRequest<DisambiguateXml> parms;
+    parms.set<DisambiguateXml::text>(copy(*req, text));
+    parms.set<DisambiguateXml::textMime>(copy(*req, textMime));
+    return call(std::move(req), parms);
+  }
+
+  // The match.json response for a filter such as {"fsk":"tide/N1"}
+  ServiceCall match(std::string_view text, std::string_view filter, std::string_view textMime = "text/plain; charset=UTF-8")
+  {
+    std::unique_ptr<AsyncRequest> req(new AsyncRequest);
+    EndpointRequest<MatchJson> parms;
+    parms.set<MatchJson::text>(copy(*req, text));
+    parms.set<MatchJson::textMime>(copy(*req, textMime));
+    parms.set<MatchJson::filter>(copy(*req, filter));
+    return call(std::move(req), parms);
+  }
+
+  // The paraphrase.xml response
+  ServiceCall paraphrase(std::string_view text, unsigned maxCount = 10, std::string_view textMime = "text/query; charset=UTF-8")
+  {
+    std::unique_ptr<AsyncRequest> req(new AsyncRequest);
+    EndpointRequest<ParaphraseXml> parms;
+    parms.set<ParaphraseXml::text>(copy(*req, text));
+    parms.set<ParaphraseXml::textMime>(copy(*req, textMime));
+    parms.set<ParaphraseXml::maxCount>(copy(*req, std::to_string(maxCount)));
+    return call(std::move(req), parms);
+  }
+
+  // The kb query.json response to a query such as [{"fs":"mouse/N1","lemma":null}]
+  ServiceCall kbQuery(std::string_view query)
+  {
+    std::unique_ptr<AsyncRequest> req(new AsyncRequest);
+    EndpointRequest<KbQueryJson> parms;
+    parms.set<KbQueryJson::query>(copy(*req, query));
+    return call(std::move(req), parms);
+  }
+
+private:
+  static std::string_view copy(AsyncRequest & req, std::string_view s)
+  {
+    return std::string_view(req.arena.strdup(s.data(), s.length()), s.length());
+  }
+
+  // As EndpointRequest::setup but keeping the body and headers in the request
+  template <class E>
+  ServiceCall call(std::unique_ptr<AsyncRequest> req, const EndpointRequest<E> & parms)
+  {
+    req->body = parms.encode(req->arena);
+    req->headers = parms.headers(req->arena);
+    curl_easy_setopt(req->curl, CURLOPT_URL, E::url.data());
+    curl_easy_setopt(req->curl, CURLOPT_POSTFIELDSIZE, (long)req->body.length());
+    curl_easy_setopt(req->curl, CURLOPT_POSTFIELDS, req->body.data());
+    curl_easy_setopt(req->curl, CURLOPT_HTTPHEADER, req->headers);
+    curl_easy_setopt(req->curl, CURLOPT_ACCEPT_ENCODING, "");
+    req->response.setup(req->curl);
+    if (!breakers_)
+      return ServiceCall(transport_, executor_, std::move(req), E::resource);
+
+    req->breaker = &breakers_->forEndpoint(E::resource);
+    curl_easy_setopt(req->curl, CURLOPT_TIMEOUT_MS, (long)req->breaker->timeout().count());
+    std::string key;
+    if (staleCache_)
+    {
+      key.reserve(E::resource.length() + 1 + req->body.length());
+      key.append(E::resource).append(1, '?').append(req->body);
+    }
+    return ServiceCall(transport_, executor_, std::move(req), E::resource, staleCache_, std::move(key));
+  }
+
+  Executor & executor_;
+  CircuitBreakers * breakers_;
+  ResponseCache * staleCache_;
+  AsyncTransport transport_;
+};
+
+} // namespace idilia
+
+#endif // IDILIA_CORO_CLIENT_H
@@ -0,0 +1,203 @@
+/*
+ * Compile-time descriptors of the endpoints and the requests built from them.
+ *
+ * A descriptor gives the resource path and url as constants and numbers the
+ * parameters of the endpoint. A request holds a fixed slot per parameter and
+ * serializes them with code generated for the endpoint: the parameter names and
+ * their separators are copied as constants and only the values are encoded.
+ * The headers that are the same for every request are built once and shared.
+ */
+
+#ifndef IDILIA_ENDPOINTS_H
+#define IDILIA_ENDPOINTS_H
+
+#include "arena.h"
+#include "http.h"
+#include "signature.h"
+
+#include <curl/curl.h>
+
+#include <array>
+#include <cstring>
+#include <string_view>
+#include <utility>
+
+namespace idilia {
+
+
+// Descriptors of the endpoints.
+// signedParm is the parameter on which the request signature is computed.
+
+struct DisambiguateXml
+{
+  static constexpr std::string_view hostname = "api.idilia.com";
+  static constexpr std::string_view resource = "/1/text/disambiguate.xml";
+  static constexpr std::string_view url = "http://api.idilia.com/1/text/disambiguate.xml";
+  enum Parm { requestId, text, textMime, numParms };
+  static constexpr std::string_view names[numParms] = {"requestId", "text", "textMime"};
+  static constexpr Parm signedParm = text;
+};
+
+struct MatchJson
+{
+  static constexpr std::string_view hostname = "api.idilia.com";
+  static constexpr std::string_view resource = "/1/text/match.json";
+  static constexpr std::string_view url = "http://api.idilia.com/1/text/match.json";
+  enum Parm { requestId, text, textMime, filter, numParms };
+  static constexpr std::string_view names[numParms] = {"requestId", "text", "textMime", "filter"};
+  static constexpr Parm signedParm = text;
+};
+
+struct ParaphraseXml
+{
+  static constexpr std::string_view hostname = "api.idilia.com";
+  static constexpr std::string_view resource = "/1/text/paraphrase.xml";
+  static constexpr std::string_view url = "http://api.idilia.com/1/text/paraphrase.xml";
+  enum Parm { requestId, text, textMime, maxCount, numParms };
+  static constexpr std::string_view names[numParms] = {"requestId", "text", "textMime", "maxCount"};
+  static constexpr Parm signedParm = text;
+};
+
+struct KbQueryJson
+{
+  static constexpr std::string_view hostname = "api.idilia.com";
+  static constexpr std::string_view resource = "/1/kb/query.json";
+  static constexpr std::string_view url = "http://api.idilia.com/1/kb/query.json";
+  enum Parm { requestId, pretty, query, numParms };
+  static constexpr std::string_view names[numParms] = {"requestId", "pretty", "query"};
+  static constexpr Parm signedParm = query;
+};
+
+
+// Checks the consistency of a descriptor at compile time
+template <class E>
+constexpr bool isValidEndpoint()
+{
+  return E::url.length() == 7 + E::hostname.length() + E::resource.length() &&
+      E::url.substr(0, 7) == "http://" &&
+      E::url.substr(7, E::hostname.length()) == E::hostname &&
+      E::url.substr(7 + E::hostname.length()) == E::resource &&
+      E::url.data()[E::url.length()] == 0; // passed as a C string to curl
+}
+
+
+// The headers of the form posts that do not depend on the request.
+// The nodes are static: they must never be freed or appended to.
+inline curl_slist * formPostHeaders()
+{
+  static char expect[] = "Expect:"; // Don't wait for this
+  static char contentType[] = "Content-Type: application/x-www-form-urlencoded; charset=UTF-8";
+  static curl_slist contentTypeNode = {contentType, 0};
+  static curl_slist expectNode = {expect, &contentTypeNode};
+  return &expectNode;
+}
+
+
+// A request to the endpoint E. The values must outlive the request.
+// Parameters never set are not sent.
+template <class E>
+class EndpointRequest
+{
+  static_assert(isValidEndpoint<E>(), "The url of the endpoint must be http://<hostname><resource>");
+
+public:
+  template <typename E::Parm P>
+  void set(std::string_view value)
+  {
+    static_assert(P < E::numParms, "Not a parameter of the endpoint");
+    slots_[P] = value.data() ? value : std::string_view("", 0);
+  }
+
+  // Set a parameter known by its name only at run time, e.g. read from a trace.
+  // Returns false if the endpoint has no such parameter.
+  bool set(std::string_view name, std::string_view value)
+  {
+    for (size_t i = 0; i < E::numParms; ++i)
+    {
+      if (E::names[i] != name)
+        continue;
+      slots_[i] = value.data() ? value : std::string_view("", 0);
+      return true;
+    }
+    return false;
+  }
+
+  std::string_view get(typename E::Parm p) const { return slots_[p]; }
+
+  // Exact length of the encoded parameters
+  size_t encodedLength() const
+  {
+    size_t len = 0;
+    for (size_t i = 0; i < E::numParms; ++i)
+      if (slots_[i].data())
+        len += (len ? 1 : 0) + E::names[i].length() + 1 + urlEncodedLength(slots_[i]);
+    return len;
+  }
+
+  // Write the url-encoded parameters at out which must have room for encodedLength() characters.
+  // Returns the end of the output.
+  char * encode(char * out) const
+  {
+    char * st = out;
+    return encodeSlots(st, out, std::make_index_sequence<E::numParms>());
+  }
+
+  // The url-encoded parameters, nul-terminated, in a single arena allocation
+  std::string_view encode(Arena & arena) const
+  {
+    char * body = (char *)arena.allocate(encodedLength() + 1, 1);
+    char * end = encode(body);
+    *end = 0;
+    return std::string_view(body, end - body);
+  }
+
+  // The signature followed by the shared headers
+  curl_slist * headers(Arena & arena) const
+  {
+    std::string_view signedText = slots_[E::signedParm];
+    curl_slist * headers = addSignature(arena, E::hostname.data(), E::resource, signedText.data(), signedText.length(), 0);
+    curl_slist * last = headers;
+    while (last->next)
+      last = last->next;
+    last->next = formPostHeaders();
+    return headers;
+  }
+
+  // Configure the handle to post the request. The body and headers are allocated in the arena.
+  void setup(Arena & arena, CURL * curl) const
+  {
+    std::string_view body = encode(arena);
+    curl_easy_setopt(curl, CURLOPT_URL, E::url.data());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)body.length());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.data());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers(arena));
+  }
+
+private:
+  template <size_t... I>
+  char * encodeSlots(const char * st, char * out, std::index_sequence<I...>) const
+  {
+    ((out = encodeSlot<I>(st, out)), ...);
+    return out;
+  }
+
+  template <size_t I>
+  char * encodeSlot(const char * st, char * out) const
+  {
+    if (!slots_[I].data())
+      return out;
+    if (out != st)
+      *out++ = '&';
+    constexpr std::string_view name = E::names[I];
+    memcpy(out, name.data(), name.length());
+    out += name.length();
+    *out++ = '=';
+    return urlEncode(slots_[I], out);
+  }
+
+  std::array<std::string_view, E::numParms> slots_; // data() is null for the parameters not set
+};
+
+} // namespace idilia
+
+#endif // IDILIA_ENDPOINTS_H
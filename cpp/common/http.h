@@ -0,0 +1,298 @@
+/*
+ * Helpers for issuing requests with libcurl and reading their responses.
+ * Everything created for a request is allocated in its Arena.
+ */
+
+#ifndef IDILIA_HTTP_H
+#define IDILIA_HTTP_H
+
+#include "arena.h"
+#include "response_buffer.h"
+
+#include <curl/curl.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace idilia {
+
+
+// Parameters of a request. The keys and values must outlive the request.
+typedef ArenaMap<std::string_view, std::string_view> RequestParms;
+
+
+// Returns true for the characters left as-is when url-encoding (RFC 3986 unreserved)
+inline bool isUrlUnreserved(unsigned char c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+      c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+#ifdef __SSE2__
+// Mask with a bit set for each of the 16 bytes at p that is unreserved.
+// Signed comparisons are fine: the bytes >= 0x80 are negative and never unreserved.
+inline unsigned urlUnreservedMask(const char * p)
+{
+  const __m128i v = _mm_loadu_si128((const __m128i *)p);
+  auto inRange = [&v](char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+  };
+  __m128i ok = _mm_or_si128(_mm_or_si128(inRange('a', 'z'), inRange('A', 'Z')), inRange('0', '9'));
+  ok = _mm_or_si128(ok, inRange('-', '.'));
+  ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+  ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, _mm_set1_epi8('~')));
+  return _mm_movemask_epi8(ok);
+}
+#endif
+
+// Exact length of s once url-encoded
+inline size_t urlEncodedLength(std::string_view s)
+{
+  const char * p = s.data();
+  const char * end = p + s.length();
+  size_t numEscaped = 0;
+#ifdef __SSE2__
+  for (; end - p >= 16; p += 16)
+    numEscaped += __builtin_popcount(~urlUnreservedMask(p) & 0xFFFF);
+#endif
+  for (; p < end; ++p)
+    numEscaped += !isUrlUnreserved(*p);
+  return s.length() + 2 * numEscaped;
+}
+
+// Url-encode s into out which must have room for urlEncodedLength(s) characters.
+// Returns the end of the output.
+// Runs of unreserved characters, the bulk of a text, are copied 16 bytes at a time.
+inline char * urlEncode(std::string_view s, char * out)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  const char * p = s.data();
+  const char * end = p + s.length();
+  auto encode = [&out](unsigned char c) {
+    if (isUrlUnreserved(c))
+      *out++ = c;
+    else
+    {
+      *out++ = '%';
+      *out++ = hex[c >> 4];
+      *out++ = hex[c & 0xF];
+    }
+  };
+#ifdef __SSE2__
+  for (; end - p >= 16; p += 16)
+  {
+    unsigned mask = urlUnreservedMask(p);
+    if (mask == 0xFFFF)
+    {
+      _mm_storeu_si128((__m128i *)out, _mm_loadu_si128((const __m128i *)p));
+      out += 16;
+      continue;
+    }
+    for (int i = 0; i < 16; ++i)
+    {
+      if (mask & (1u << i))
+        *out++ = p[i];
+      else
+        encode(p[i]);
+    }
+  }
+#endif
+  for (; p < end; ++p)
+    encode(*p);
+  return out;
+}
+
+// Decode a url-encoded value, with '+' standing for a space. Invalid escapes are kept as-is.
+inline std::string urlDecode(std::string_view s)
+{
+  auto hexValue = [](char c) {
+    return c >= '0' && c <= '9' ? c - '0' : c >= 'A' && c <= 'F' ? c - 'A' + 10 : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+  };
+  std::string out;
+  out.reserve(s.length());
+  for (size_t i = 0; i < s.length(); ++i)
+  {
+    int hi, lo;
+    if (s[i] == '+')
+      out += ' ';
+    else if (s[i] == '%' && i + 2 < s.length() && (hi = hexValue(s[i + 1])) >= 0 && (lo = hexValue(s[i + 2])) >= 0)
+    {
+      out += char(hi << 4 | lo);
+      i += 2;
+    }
+    else
+      out += s[i];
+  }
+  return out;
+}
+
+
+// Helper function to assemble url-encoded parameters from a map.
+// A first pass computes the exact length so that the result is written in a single
+// arena allocation. The result is nul-terminated.
+inline std::string_view convertToQueryParms(Arena & arena, const RequestParms & parms)
+{
+  size_t len = 0;
+  for (RequestParms::const_iterator it = parms.begin(); it != parms.end(); ++it)
+    len += (len ? 1 : 0) + it->first.length() + 1 + urlEncodedLength(it->second);
+
+  char * res = (char *)arena.allocate(len + 1, 1);
+  char * o = res;
+  for (RequestParms::const_iterator it = parms.begin(); it != parms.end(); ++it)
+  {
+    if (o != res)
+      *o++ = '&';
+    memcpy(o, it->first.data(), it->first.length());
+    o += it->first.length();
+    *o++ = '=';
+    o = urlEncode(it->second, o);
+  }
+  *o = 0;
+  return std::string_view(res, o - res);
+}
+
+
+// Simple class to format an HTTP multipart POST request given that the server expects
+// a multipart/mixed body and not the multipart/form-data assembled by libcurl.
+// Using this class avoids having to urlencode the possibly large document.
+struct MultipartHttpPostRequest
+{
+  MultipartHttpPostRequest(Arena & arena, std::string_view boundary = "--------YmM9XyV7I10ncTJJSzZD") :
+    boundary(boundary), parts(arena)
+  {
+    contentType = arena.concat({"multipart/mixed; boundary=", boundary});
+  }
+
+  // Add a part. The payload must outlive the request.
+  void addPart(const ArenaMap<std::string_view, std::string_view> & headers, std::string_view payload)
+  {
+    Arena & arena = *parts.get_allocator().arena;
+    size_t len = 0;
+    for (auto it = headers.begin(); it != headers.end(); ++it)
+      len += it->first.length() + 2 + it->second.length() + 2;
+    char * hdrs = (char *)arena.allocate(len, 1);
+    char * o = hdrs;
+    for (auto it = headers.begin(); it != headers.end(); ++it)
+    {
+      memcpy(o, it->first.data(), it->first.length()); o += it->first.length();
+      memcpy(o, ": ", 2); o += 2;
+      memcpy(o, it->second.data(), it->second.length()); o += it->second.length();
+      memcpy(o, "\r\n", 2); o += 2;
+    }
+    parts.push_back(std::make_pair(std::string_view(hdrs, len), payload));
+  }
+
+  void addPart(std::string_view contentType, std::string_view payload)
+  {
+    ArenaMap<std::string_view, std::string_view> headers(*parts.get_allocator().arena);
+    headers["Content-Type"] = contentType;
+    addPart(headers, payload);
+  }
+
+  // The body of the request, assembled in the arena
+  std::string_view encoded() const
+  {
+    // --<boundary>\r\n<headers>\r\n<payload>\r\n for each part, then --<boundary>--
+    size_t len = 0;
+    for (size_t i = 0; i < parts.size(); ++i)
+      len += 2 + boundary.length() + 2 + parts[i].first.length() + 2 + parts[i].second.length() + 2;
+    len += 2 + boundary.length() + 2;
+
+    char * body = (char *)parts.get_allocator().arena->allocate(len, 1);
+    char * o = body;
+    for (size_t i = 0; i < parts.size(); ++i)
+    {
+      memcpy(o, "--", 2); o += 2;
+      memcpy(o, boundary.data(), boundary.length()); o += boundary.length();
+      memcpy(o, "\r\n", 2); o += 2;
+      memcpy(o, parts[i].first.data(), parts[i].first.length()); o += parts[i].first.length();
+      memcpy(o, "\r\n", 2); o += 2;
+      memcpy(o, parts[i].second.data(), parts[i].second.length()); o += parts[i].second.length();
+      memcpy(o, "\r\n", 2); o += 2;
+    }
+    memcpy(o, "--", 2); o += 2;
+    memcpy(o, boundary.data(), boundary.length()); o += boundary.length();
+    memcpy(o, "--", 2);
+    return std::string_view(body, len);
+  }
+
+  std::string_view boundary;
+  std::string_view contentType;
+  ArenaVector<std::pair<std::string_view, std::string_view> > parts; // headers and payload
+};
+
+
+// Simple class for parsing an HTTP multipart response given that not provided by libcurl.
+// The parts refer to the body that must therefore not be modified after parsing.
+struct MultipartHttpResponse
+{
+  MultipartHttpResponse(Arena & arena) : parts(arena), body(arena) {}
+
+  bool parse()
+  {
+    return parse(body.view());
+  }
+
+  // Parse a response downloaded elsewhere. The parts refer to it.
+  bool parse(const RopeView & body)
+  {
+    Arena & arena = *parts.get_allocator().arena;
+
+    // Get the boundary. It starts at the 3rd character (after --) and ends with the \r\n
+    if (body.length() < 2 || body[0] != '-' || body[1] != '-')
+      return false;
+    size_t delimLen = body.find("\r\n");
+    if (delimLen == RopeView::npos)
+      return false;
+    std::string_view partDelim = flatten(arena, body.substr(0, delimLen));
+
+    // Split all the parts and their headers
+    for (size_t partPos = partDelim.length(); partPos < body.length() && body[partPos] != '-'; )
+    {
+      size_t hdrStPos = partPos + 2;
+      size_t bodyPos = body.find("\r\n\r\n", hdrStPos);
+      if (bodyPos == RopeView::npos)
+        return false;
+
+      bodyPos += 4;
+      size_t bodyEndPos = body.find(partDelim, bodyPos);
+      if (bodyEndPos == RopeView::npos)
+        return false;
+
+      partPos = bodyEndPos + partDelim.length();
+      parts.push_back(Part(arena));
+      Part & part = parts.back();
+
+      // Split the headers
+      for (size_t hdrPos = hdrStPos, hdrNextPos; hdrPos < bodyPos && body[hdrPos] != '\r'; hdrPos = hdrNextPos + 2) {
+        hdrNextPos = body.find("\r\n", hdrPos);
+        size_t delimPos = body.find(": ", hdrPos);
+        std::string_view key = flatten(arena, body.substr(hdrPos, delimPos - hdrPos));
+        delimPos += 2;
+        part.headers[key] = flatten(arena, body.substr(delimPos, hdrNextPos - delimPos));
+      }
+
+      part.body = body.substr(bodyPos, bodyEndPos - bodyPos - 2);
+    }
+    return true;
+  }
+
+  struct Part {
+    Part(Arena & arena) : headers(arena) {}
+    ArenaMap<std::string_view, std::string_view> headers;
+    RopeView body;
+  };
+
+  ArenaVector<Part> parts; // the parts that can be read by the application
+  ResponseBuffer body;     // buffer accumulating the HTTP response
+};
+
+} // namespace idilia
+
+#endif // IDILIA_HTTP_H
@@ -0,0 +1,445 @@
+/*
+ * Incremental disambiguation of documents that are edited and disambiguated again.
+ *
+ * A document is split into segments at paragraph boundaries, and long paragraphs
+ * at sentence boundaries chosen from their content, so that an edit changes the
+ * segments it touches and leaves the boundaries of the others where they were.
+ * The senses of each segment are cached by its length and two independent hashes
+ * of its text, with offsets relative to the segment. Disambiguating a new version only sends the segments not in the
+ * cache, grouped in runs of adjacent segments with some of the surrounding text as
+ * context, and splices the cached and new senses into offsets of the whole document.
+ *
+ * The responses are parsed on the transport's thread, or handed to a WorkStealingPool
+ * so that the parsing of large documents does not hold back the transfers.
+ */
+
+#ifndef IDILIA_INCREMENTAL_H
+#define IDILIA_INCREMENTAL_H
+
+#include "endpoints.h"
+#include "lru_cache.h"
+#include "senses.h"
+#include "transport.h"
+#include "work_pool.h"
+#include "xml.h"
+
+#include <libxml/parser.h>
+
+#include <curl/curl.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace idilia {
+
+
+inline uint64_t segmentHash(std::string_view text)
+{
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < text.length(); ++i)
+    h = (h ^ (unsigned char)text[i]) * 1099511628211ULL;
+  return (h ^ text.length()) * 1099511628211ULL;
+}
+
+
+// A hash independent of segmentHash verifying it: the text is mixed 8 bytes at a time
+inline uint64_t segmentCheck(std::string_view text)
+{
+  uint64_t h = 0x9E3779B97F4A7C15ULL ^ text.length();
+  size_t i = 0;
+  for (; i + 8 <= text.length(); i += 8)
+  {
+    uint64_t w;
+    memcpy(&w, text.data() + i, 8);
+    h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 29;
+  }
+  uint64_t w = 0;
+  memcpy(&w, text.data() + i, text.length() - i);
+  h = (h ^ w) * 0xC4CEB9FE1A85EC53ULL;
+  return h ^ (h >> 32);
+}
+
+
+// The identity of the text of a segment in the cache. Two texts are taken as the
+// same when both hashes and the length are equal.
+struct SegmentKey
+{
+  uint64_t hash;
+  uint64_t check;
+  uint32_t length;
+
+  bool operator==(const SegmentKey & o) const { return hash == o.hash && check == o.check && length == o.length; }
+};
+
+struct SegmentKeyHash
+{
+  size_t operator()(const SegmentKey & k) const { return k.hash; }
+};
+
+inline SegmentKey segmentKey(std::string_view text)
+{
+  return SegmentKey{segmentHash(text), segmentCheck(text), (uint32_t)text.length()};
+}
+
+
+// A segment of a document: its text without the whitespace that separates it from the next one
+struct TextSegment
+{
+  uint32_t offset;
+  uint32_t length;
+  SegmentKey key; // of the text
+};
+
+
+inline bool isTextSpace(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+
+// Split a paragraph longer than maxBytes after the ends of sentences. A segment ends after a
+// sentence whose hash selects it once it has maxBytes / 4, and always once it has maxBytes / 2,
+// so an edit moves at most the boundary following it. Sentences longer than maxBytes are cut between words.
+inline void splitParagraph(std::string_view text, size_t st, size_t en, size_t maxBytes, std::vector<TextSegment> & out)
+{
+  size_t segSt = st, sentSt = st;
+  auto cut = [&](size_t end) {
+    size_t e = end;
+    while (e > segSt && isTextSpace(text[e - 1]))
+      --e;
+    if (e > segSt)
+      out.push_back(TextSegment{(uint32_t)segSt, (uint32_t)(e - segSt), segmentKey(text.substr(segSt, e - segSt))});
+    while (end < en && isTextSpace(text[end]))
+      ++end;
+    segSt = sentSt = end;
+  };
+
+  for (size_t p = st; p < en; ++p)
+  {
+    if (p - segSt >= maxBytes)
+    {
+      // No sentence end: cut at the last space, or before a UTF-8 lead byte
+      size_t c = p;
+      while (c > segSt && !isTextSpace(text[c]))
+        --c;
+      if (c == segSt)
+        for (c = p; c > segSt && (text[c] & 0xC0) == 0x80; --c)
+          ;
+      cut(c > segSt ? c : p);
+      p = segSt;
+      if (p >= en)
+        break;
+    }
+    char ch = text[p];
+    if ((ch != '.' && ch != '!' && ch != '?') || (p + 1 < en && !isTextSpace(text[p + 1])))
+      continue;
+    size_t len = p + 1 - segSt;
+    if (len >= maxBytes / 2 || (len >= maxBytes / 4 && segmentHash(text.substr(sentSt, p + 1 - sentSt)) % 4 == 0))
+    {
+      cut(p + 1);
+      p = segSt - 1;
+    }
+    else
+    {
+      for (sentSt = p + 1; sentSt < en && isTextSpace(text[sentSt]); ++sentSt)
+        ;
+    }
+  }
+  if (segSt < en)
+    cut(en);
+}
+
+
+// Split a text into segments at blank lines, and long paragraphs at sentence ends
+inline void splitSegments(std::string_view text, size_t maxBytes, std::vector<TextSegment> & out)
+{
+  out.clear();
+  size_t p = 0;
+  while (p < text.length())
+  {
+    while (p < text.length() && isTextSpace(text[p]))
+      ++p;
+    if (p == text.length())
+      break;
+    size_t en = text.find("\n\n", p);
+    size_t en2 = text.find("\n\r\n", p);
+    en = std::min(std::min(en, en2), text.length());
+    splitParagraph(text, p, en, maxBytes, out);
+    p = en;
+  }
+}
+
+
+// Options of the IncrementalDisambiguator
+struct IncrementalOptions
+{
+  size_t maxSegmentBytes = 2048;  // paragraphs longer than this are split at sentence ends
+  size_t contextBytes = 512;      // text sent before and after a run of segments
+  size_t maxRequestBytes = 16384; // of segments in one request, without the context
+  size_t cacheSize = 100000;      // number of segments whose senses are cached
+  unsigned maxConcurrent = 8;     // requests in progress
+  std::string textMime = "text/plain; charset=UTF-8";
+};
+
+
+class IncrementalDisambiguator
+{
+public:
+  typedef IncrementalOptions Options;
+
+  struct Stats
+  {
+    size_t numSegments = 0;
+    size_t numReused = 0;     // segments found in the cache or repeated in the document
+    size_t numSent = 0;       // segments disambiguated
+    size_t numRequests = 0;
+    size_t bytesSent = 0;     // of text, including the context
+  };
+
+  // The dictionary, and the pool parsing the responses if given, must outlive the disambiguator
+  explicit IncrementalDisambiguator(SenseKeyDictionary & dict, const Options & options = Options(),
+      WorkStealingPool * parsers = 0) :
+    dict_(dict), options_(options), parsers_(parsers), cache_(options.cacheSize), transport_(options.maxConcurrent) {}
+
+  // The senses of the text with offsets in the text, as extractSenses would give for the whole text.
+  // Only the segments not seen in earlier texts are sent. One text at a time.
+  Stats disambiguate(std::string_view text, CompactSenses & out)
+  {
+    Stats stats;
+    std::vector<TextSegment> segments;
+    splitSegments(text, options_.maxSegmentBytes, segments);
+    stats.numSegments = segments.size();
+
+    // The senses of each segment: from the cache, or to be filled by the requests
+    std::vector<SensesPtr> senses(segments.size());
+    FreshSenses fresh;
+    std::vector<bool> send(segments.size(), false);
+    for (size_t i = 0; i < segments.size(); ++i)
+    {
+      if ((senses[i] = cache_.get(segments[i].key)))
+        continue;
+      std::shared_ptr<CompactSenses> & f = fresh[segments[i].key];
+      if (!f)
+      {
+        f = std::make_shared<CompactSenses>();
+        send[i] = true;
+      }
+      senses[i] = f;
+    }
+
+    // Runs of adjacent segments to send, each in a request
+    Completion done;
+    try
+    {
+      for (size_t i = 0; i < segments.size(); )
+      {
+        if (!send[i])
+        {
+          ++i;
+          continue;
+        }
+        size_t first = i++;
+        while (i < segments.size() && send[i] &&
+               segments[i].offset + segments[i].length - segments[first].offset <= options_.maxRequestBytes)
+          ++i;
+        submitRun(text, segments, first, i, fresh, done, stats);
+      }
+    }
+    catch (...)
+    {
+      done.wait();
+      throw;
+    }
+    done.wait();
+    if (!done.error.empty())
+      throw std::runtime_error(done.error);
+
+    // Splice the senses of the segments
+    out.clear();
+    for (size_t i = 0; i < segments.size(); ++i)
+    {
+      if (send[i])
+        cache_.put(segments[i].key, senses[i]);
+      else
+        stats.numReused += 1;
+      for (size_t k = 0; k < senses[i]->size(); ++k)
+      {
+        SenseOccurrence occ = (*senses[i])[k];
+        occ.offset += segments[i].offset;
+        out.push_back(occ);
+      }
+    }
+    stats.numSent = stats.numSegments - stats.numReused;
+    return stats;
+  }
+
+private:
+  typedef LruCache<SegmentKey, CompactSenses, SegmentKeyHash> SensesCache;
+  typedef SensesCache::ValuePtr SensesPtr;
+
+  // The senses of the segments sent, filled by the requests
+  typedef std::unordered_map<SegmentKey, std::shared_ptr<CompactSenses>, SegmentKeyHash> FreshSenses;
+
+  // Extract the senses of a semdoc and free it. Returns false when it could not be parsed.
+  // Thread safe: the dictionary locks itself.
+  bool extract(xmlDocPtr doc, std::string_view text, CompactSenses & out)
+  {
+    if (!doc)
+      return false;
+    extractSenses(doc, text, dict_, out);
+    xmlFreeDoc(doc);
+    return true;
+  }
+
+  // Requests of a text in progress. Updated on the transport's thread.
+  struct Completion
+  {
+    std::mutex m;
+    std::condition_variable cv;
+    size_t numOutstanding = 0;
+    std::string error;        // of the first request that failed
+
+    void wait()
+    {
+      std::unique_lock<std::mutex> lock(m);
+      cv.wait(lock, [this] { return numOutstanding == 0; });
+    }
+  };
+
+  // Disambiguate segments [first, last) with their context. The senses are distributed to
+  // the segments with offsets relative to them; those found in the context are dropped.
+  void submitRun(std::string_view text, const std::vector<TextSegment> & segments, size_t first, size_t last,
+      FreshSenses & fresh, Completion & done, Stats & stats)
+  {
+    size_t runSt = segments[first].offset;
+    size_t runEn = segments[last - 1].offset + segments[last - 1].length;
+
+    // Context starting and ending between words
+    size_t winSt = runSt > options_.contextBytes ? runSt - options_.contextBytes : 0;
+    if (winSt > 0)
+    {
+      while (winSt < runSt && !isTextSpace(text[winSt - 1]))
+        ++winSt;
+    }
+    size_t winEn = std::min(text.length(), runEn + options_.contextBytes);
+    while (winEn > runEn && winEn < text.length() && !isTextSpace(text[winEn]))
+      --winEn;
+    std::string_view window = text.substr(winSt, winEn - winSt);
+
+    // Where the senses go: the start of each segment and its senses
+    std::vector<std::pair<size_t, std::shared_ptr<CompactSenses> > > targets;
+    for (size_t i = first; i < last; ++i)
+      targets.push_back(std::make_pair(segments[i].offset - winSt, fresh[segments[i].key]));
+    size_t runStInWin = runSt - winSt, runEnInWin = runEn - winSt;
+
+    std::unique_ptr<AsyncRequest> req(new AsyncRequest);
+    EndpointRequest<DisambiguateXml> parms;
+    parms.set<DisambiguateXml::text>(window);
+    parms.set<DisambiguateXml::textMime>(options_.textMime);
+    req->body = parms.encode(req->arena);
+    req->headers = parms.headers(req->arena);
+    curl_easy_setopt(req->curl, CURLOPT_URL, DisambiguateXml::url.data());
+    curl_easy_setopt(req->curl, CURLOPT_POSTFIELDSIZE, (long)req->body.length());
+    curl_easy_setopt(req->curl, CURLOPT_POSTFIELDS, req->body.data());
+    curl_easy_setopt(req->curl, CURLOPT_HTTPHEADER, req->headers);
+    curl_easy_setopt(req->curl, CURLOPT_ACCEPT_ENCODING, "");
+    req->response.setup(req->curl);
+
+    // The caller waits for the completion: the text is not modified while the responses are parsed.
+    // Each run has its own targets. Parsed with the worker's parser when on the pool.
+    auto finish = [this, window, targets, runStInWin, runEnInWin, &done](AsyncRequest & r, CURLcode cc, long httpCode,
+        xmlParserCtxtPtr parser) {
+      std::string error;
+      if (cc != CURLE_OK)
+        error = curl_easy_strerror(cc);
+      else if (httpCode != 200)
+      {
+        std::stringstream ss; ss << httpCode << ' ' << r.response.str();
+        error = ss.str();
+      }
+      else
+      {
+        CompactSenses found;
+        bool parsed;
+        if (parser)
+          parsed = extract(readXmlDoc(parser, r.response.view()), window, found);
+        else
+        {
+          XmlArenaScope xmlScope(r.arena);
+          parsed = extract(readXmlDoc(r.response.view()), window, found);
+        }
+        if (!parsed)
+          error = "Could not recover semdoc format";
+        size_t t = 0;
+        for (size_t k = 0; k < found.size(); ++k)
+        {
+          SenseOccurrence occ = found[k];
+          if (occ.offset < runStInWin || occ.offset >= runEnInWin)
+            continue;
+          while (t + 1 < targets.size() && targets[t + 1].first <= occ.offset)
+            ++t;
+          occ.offset -= targets[t].first;
+          targets[t].second->push_back(occ);
+        }
+      }
+
+      std::lock_guard<std::mutex> lock(done.m);
+      if (done.error.empty())
+        done.error = error;
+      if (--done.numOutstanding == 0)
+        done.cv.notify_all();
+    };
+    if (!parsers_)
+      req->onDone = [finish](AsyncRequest & r, CURLcode cc, long httpCode) { finish(r, cc, httpCode, 0); };
+    else
+    {
+      // The response is parsed in place: the pool's task owns the request
+      req->handOff = [this, finish](std::unique_ptr<AsyncRequest> r, CURLcode cc, long httpCode) {
+        AsyncRequest * owned = r.get();
+        try
+        {
+          parsers_->submit([finish, owned, cc, httpCode](WorkerContext & ctx) {
+            std::unique_ptr<AsyncRequest> r(owned);
+            finish(*r, cc, httpCode, ctx.xmlParser);
+          });
+        }
+        catch (const std::exception &)
+        {
+          // Not queued: parsed here so that the text is still completed
+          finish(*r, cc, httpCode, 0);
+          return;
+        }
+        r.release();
+      };
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(done.m);
+      ++done.numOutstanding;
+    }
+    stats.numRequests += 1;
+    stats.bytesSent += window.length();
+    transport_.submit(std::move(req));
+  }
+
+  SenseKeyDictionary & dict_;
+  Options options_;
+  WorkStealingPool * parsers_;
+  SensesCache cache_;
+  AsyncTransport transport_; // declared last: stopped first
+};
+
+} // namespace idilia
+
+#endif // IDILIA_INCREMENTAL_H
@@ -0,0 +1,173 @@
+/*
+ * Minimal reading of the JSON objects returned by the server.
+ *
+ * Only what the samples need: reading the string members of the top-level object.
+ * Use your favorite JSON library for anything more.
+ */
+
+#ifndef IDILIA_JSON_H
+#define IDILIA_JSON_H
+
+#include <cstdlib>
+#include <string>
+#include <string_view>
+
+namespace idilia {
+
+
+// Append the UTF-8 encoding of a code point
+inline void appendUtf8(std::string & out, unsigned cp)
+{
+  if (cp < 0x80)
+    out += (char)cp;
+  else if (cp < 0x800)
+  {
+    out += (char)(0xC0 | (cp >> 6));
+    out += (char)(0x80 | (cp & 0x3F));
+  }
+  else if (cp < 0x10000)
+  {
+    out += (char)(0xE0 | (cp >> 12));
+    out += (char)(0x80 | ((cp >> 6) & 0x3F));
+    out += (char)(0x80 | (cp & 0x3F));
+  }
+  else
+  {
+    out += (char)(0xF0 | (cp >> 18));
+    out += (char)(0x80 | ((cp >> 12) & 0x3F));
+    out += (char)(0x80 | ((cp >> 6) & 0x3F));
+    out += (char)(0x80 | (cp & 0x3F));
+  }
+}
+
+
+// Decode the JSON string starting at json[pos] (the opening quote).
+// On success, pos is left after the closing quote.
+inline bool jsonReadString(std::string_view json, size_t & pos, std::string * out)
+{
+  if (pos >= json.length() || json[pos] != '"')
+    return false;
+  for (size_t i = pos + 1; i < json.length(); )
+  {
+    char c = json[i++];
+    if (c == '"')
+    {
+      pos = i;
+      return true;
+    }
+    if (c != '\\')
+    {
+      if (out)
+        *out += c;
+      continue;
+    }
+    if (i >= json.length())
+      return false;
+    char e = json[i++];
+    if (e == 'u')
+    {
+      if (i + 4 > json.length())
+        return false;
+      unsigned cp = strtoul(std::string(json.substr(i, 4)).c_str(), 0, 16);
+      i += 4;
+      // Combine a surrogate pair
+      if (cp >= 0xD800 && cp < 0xDC00 && i + 6 <= json.length() && json[i] == '\\' && json[i + 1] == 'u')
+      {
+        unsigned lo = strtoul(std::string(json.substr(i + 2, 4)).c_str(), 0, 16);
+        if (lo >= 0xDC00 && lo < 0xE000)
+        {
+          cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+          i += 6;
+        }
+      }
+      if (out)
+        appendUtf8(*out, cp);
+      continue;
+    }
+    if (out)
+    {
+      switch (e)
+      {
+      case 'b': *out += '\b'; break;
+      case 'f': *out += '\f'; break;
+      case 'n': *out += '\n'; break;
+      case 'r': *out += '\r'; break;
+      case 't': *out += '\t'; break;
+      default:  *out += e; break; // \" \\ and \/
+      }
+    }
+  }
+  return false;
+}
+
+
+// Skip the JSON value starting at json[pos]
+inline bool jsonSkipValue(std::string_view json, size_t & pos)
+{
+  if (pos >= json.length())
+    return false;
+  if (json[pos] == '"')
+    return jsonReadString(json, pos, 0);
+  if (json[pos] != '{' && json[pos] != '[')
+  {
+    // number, true, false or null
+    pos = json.find_first_of(",}] \t\r\n", pos);
+    return pos != std::string_view::npos;
+  }
+
+  int depth = 0;
+  while (pos < json.length())
+  {
+    char c = json[pos];
+    if (c == '"')
+    {
+      if (!jsonReadString(json, pos, 0))
+        return false;
+      continue;
+    }
+    ++pos;
+    if (c == '{' || c == '[')
+      ++depth;
+    else if ((c == '}' || c == ']') && --depth == 0)
+      return true;
+  }
+  return false;
+}
+
+
+// Read the string member name of the top-level object.
+// Returns false if absent or not a string.
+inline bool jsonStringMember(std::string_view json, std::string_view name, std::string & value)
+{
+  size_t pos = json.find('{');
+  if (pos == std::string_view::npos)
+    return false;
+  ++pos;
+  std::string key;
+  for (;;)
+  {
+    pos = json.find_first_not_of(" \t\r\n,", pos);
+    if (pos == std::string_view::npos || json[pos] != '"')
+      return false;
+    key.clear();
+    if (!jsonReadString(json, pos, &key))
+      return false;
+    pos = json.find_first_not_of(" \t\r\n", pos);
+    if (pos == std::string_view::npos || json[pos] != ':')
+      return false;
+    pos = json.find_first_not_of(" \t\r\n", pos + 1);
+    if (pos == std::string_view::npos)
+      return false;
+    if (key == name)
+    {
+      value.clear();
+      return jsonReadString(json, pos, &value);
+    }
+    if (!jsonSkipValue(json, pos))
+      return false;
+  }
+}
+
+} // namespace idilia
+
+#endif // IDILIA_JSON_H
@@ -0,0 +1,117 @@
+/*
+ * Thread safe cache of immutable values with least-recently-used eviction.
+ * The capacity is a number of entries, or a total cost such as bytes.
+ */
+
+#ifndef IDILIA_LRU_CACHE_H
+#define IDILIA_LRU_CACHE_H
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+namespace idilia {
+
+
+// The cost of every entry is 1: the capacity is a number of entries
+struct EntryCount
+{
+  template <class K, class V>
+  size_t operator()(const K &, const V &) const { return 1; }
+};
+
+
+// Values are shared so that a reader keeps its copy valid after eviction.
+// Cost gives the cost of an entry from its key and value; the least recently
+// used entries are evicted while the total exceeds the capacity.
+template <class K, class V, class Hash = std::hash<K>, class Cost = EntryCount>
+class LruCache
+{
+public:
+  typedef std::shared_ptr<const V> ValuePtr;
+
+  explicit LruCache(size_t capacity) : capacity_(capacity), cost_(0) {}
+
+  // Returns the cached value or an empty pointer
+  ValuePtr get(const K & key)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    typename Map::iterator it = map_.find(key);
+    if (it == map_.end())
+      return ValuePtr();
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return it->second->value;
+  }
+
+  // A value costing more than the capacity is not kept: the previous value of the key is dropped
+  void put(const K & key, ValuePtr value)
+  {
+    size_t cost = Cost()(key, *value);
+    std::lock_guard<std::mutex> lock(mutex_);
+    typename Map::iterator it = map_.find(key);
+    if (cost > capacity_)
+    {
+      if (it != map_.end())
+      {
+        cost_ -= it->second->cost;
+        lru_.erase(it->second);
+        map_.erase(it);
+      }
+      return;
+    }
+    if (it != map_.end())
+    {
+      cost_ -= it->second->cost;
+      it->second->value = std::move(value);
+      it->second->cost = cost;
+      lru_.splice(lru_.begin(), lru_, it->second);
+    }
+    else
+    {
+      lru_.push_front(Entry{key, std::move(value), cost});
+      map_[key] = lru_.begin();
+    }
+    cost_ += cost;
+    while (cost_ > capacity_)
+    {
+      cost_ -= lru_.back().cost;
+      map_.erase(lru_.back().key);
+      lru_.pop_back();
+    }
+  }
+
+  size_t size() const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return map_.size();
+  }
+
+  // Total cost of the entries
+  size_t cost() const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return cost_;
+  }
+
+private:
+  struct Entry
+  {
+    K key;
+    ValuePtr value;
+    size_t cost;
+  };
+  typedef std::list<Entry> List;
+  typedef std::unordered_map<K, typename List::iterator, Hash> Map;
+
+  size_t capacity_;
+  mutable std::mutex mutex_;
+  size_t cost_; // protected by mutex_
+  List lru_;    // most recently used first
+  Map map_;
+};
+
+} // namespace idilia
+
+#endif // IDILIA_LRU_CACHE_H
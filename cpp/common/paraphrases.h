@@ -0,0 +1,70 @@
+/*
+ * Decoding of the paraphrase.xml responses.
+ */
+
+#ifndef IDILIA_PARAPHRASES_H
+#define IDILIA_PARAPHRASES_H
+
+#include <libxml/tree.h>
+#include <libxml/xpath.h>
+
+#include <string>
+#include <vector>
+
+namespace idilia {
+
+
+struct Paraphrase
+{
+  std::string surface;
+  std::string weight;
+};
+
+struct Paraphrases
+{
+  std::string confidence; // overall confidence of the query, empty if not given
+  std::vector<Paraphrase> paraphrases;
+};
+
+
+// Decode a parsed paraphrase.xml response
+inline void decodeParaphrases(xmlDocPtr doc, Paraphrases & out)
+{
+  out.confidence.clear();
+  out.paraphrases.clear();
+  xmlXPathContextPtr context = xmlXPathNewContext(doc);
+
+  // The overall query confidence
+  xmlXPathObjectPtr conf = xmlXPathEvalExpression((const xmlChar *) "//queryConf/confCorrectFineMostProbable", context);
+  if (conf && conf->nodesetval && conf->nodesetval->nodeNr > 0)
+  {
+    xmlChar * val = xmlNodeListGetString(doc, conf->nodesetval->nodeTab[0]->xmlChildrenNode, 1);
+    if (val)
+      out.confidence.assign((const char *)val);
+    xmlFree(val);
+  }
+  xmlXPathFreeObject(conf);
+
+  // The paraphrases
+  xmlXPathObjectPtr result = xmlXPathEvalExpression((const xmlChar *) "//paraphrase", context);
+  for (int i = 0; result && result->nodesetval && i < result->nodesetval->nodeNr; i++)
+  {
+    out.paraphrases.emplace_back();
+    Paraphrase & p = out.paraphrases.back();
+    for (xmlNodePtr child = result->nodesetval->nodeTab[i]->xmlChildrenNode; child; child = child->next)
+    {
+      xmlChar * val = xmlNodeListGetString(doc, child->xmlChildrenNode, 1);
+      if (0 == xmlStrcmp(child->name, (const xmlChar *) "surface"))
+        p.surface.assign(val ? (const char *)val : "");
+      else if (0 == xmlStrcmp(child->name, (const xmlChar *) "weight"))
+        p.weight.assign(val ? (const char *)val : "");
+      xmlFree(val);
+    }
+  }
+  xmlXPathFreeObject(result);
+  xmlXPathFreeContext(context);
+}
+
+} // namespace idilia
+
+#endif // IDILIA_PARAPHRASES_H
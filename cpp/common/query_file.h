@@ -0,0 +1,314 @@
+/*
+ * Memory-mapped reader for input files containing one query per line.
+ *
+ * The file is mapped read-only and never copied: lines are handed out as
+ * string_view items pointing into the mapping. The file is split into chunks
+ * aligned on line boundaries that worker threads claim one at a time. Each chunk
+ * knows the number of its first line so that results can still be associated
+ * with the line number of the query in the file.
+ *
+ * Requires C++17 for std::string_view.
+ */
+
+#ifndef IDILIA_QUERY_FILE_H
+#define IDILIA_QUERY_FILE_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace idilia {
+
+
+// Count the newline characters in [p, end).
+// Uses 16 byte SSE2 comparisons when available. This is the only pass made over
+// the whole file before processing starts so it needs to run at memory speed.
+inline size_t countNewlines(const char * p, const char * end)
+{
+  size_t count = 0;
+#ifdef __SSE2__
+  const __m128i nl = _mm_set1_epi8('\n');
+  for (; end - p >= 64; p += 64)
+  {
+    __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), nl);
+    __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 16)), nl);
+    __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 32)), nl);
+    __m128i d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 48)), nl);
+    uint64_t mask =
+        (uint64_t)(uint16_t)_mm_movemask_epi8(a) |
+        ((uint64_t)(uint16_t)_mm_movemask_epi8(b) << 16) |
+        ((uint64_t)(uint16_t)_mm_movemask_epi8(c) << 32) |
+        ((uint64_t)(uint16_t)_mm_movemask_epi8(d) << 48);
+    count += __builtin_popcountll(mask);
+  }
+#endif
+  for (; p < end; ++p)
+    count += *p == '\n';
+  return count;
+}
+
+
+// Validate that [p, p+len) is well formed UTF-8 (no overlongs, surrogates or
+// code points above U+10FFFF). Runs of ASCII are skipped 8 bytes at a time.
+inline bool isValidUtf8(const char * str, size_t len)
+{
+  const unsigned char * p = (const unsigned char *)str;
+  const unsigned char * end = p + len;
+  while (p < end)
+  {
+    if (end - p >= 8)
+    {
+      uint64_t w;
+      memcpy(&w, p, 8);
+      if ((w & 0x8080808080808080ULL) == 0)
+      {
+        p += 8;
+        continue;
+      }
+    }
+
+    unsigned char c = *p;
+    if (c < 0x80)
+    {
+      ++p;
+      continue;
+    }
+
+    size_t n;
+    unsigned char lo = 0x80, hi = 0xBF; // allowed range of the 2nd byte
+    if (c >= 0xC2 && c <= 0xDF)
+      n = 2;
+    else if (c >= 0xE0 && c <= 0xEF)
+    {
+      n = 3;
+      if (c == 0xE0) lo = 0xA0;
+      else if (c == 0xED) hi = 0x9F;
+    }
+    else if (c >= 0xF0 && c <= 0xF4)
+    {
+      n = 4;
+      if (c == 0xF0) lo = 0x90;
+      else if (c == 0xF4) hi = 0x8F;
+    }
+    else
+      return false;
+
+    if ((size_t)(end - p) < n || p[1] < lo || p[1] > hi)
+      return false;
+    for (size_t i = 2; i < n; ++i)
+      if ((p[i] & 0xC0) != 0x80)
+        return false;
+    p += n;
+  }
+  return true;
+}
+
+
+// A query read from the file
+struct QueryLine
+{
+  size_t lineNo;         // 0-based line number in the file
+  std::string_view text; // without the line terminator
+};
+
+
+// A range of complete lines of the file
+struct QueryChunk
+{
+  const char * begin;
+  const char * end;
+  size_t firstLineNo;
+};
+
+
+// Iterates over the lines of a chunk, skipping those that are not to be processed.
+struct QueryLineCursor
+{
+  QueryLineCursor(const QueryChunk & chunk, bool skipEmpty, bool validateUtf8) :
+    p_(chunk.begin), end_(chunk.end), lineNo_(chunk.firstLineNo),
+    skipEmpty_(skipEmpty), validateUtf8_(validateUtf8), numInvalid_(0) {}
+
+  // Get the next line to process. Returns false when the chunk is exhausted.
+  bool next(QueryLine & line)
+  {
+    while (p_ < end_)
+    {
+      const char * eol = (const char *)memchr(p_, '\n', end_ - p_);
+      if (!eol)
+        eol = end_;
+      const char * st = p_;
+      const char * en = eol;
+      if (en > st && en[-1] == '\r')
+        --en;
+      size_t lineNo = lineNo_++;
+      p_ = eol + 1;
+
+      if (en == st && skipEmpty_)
+        continue;
+      if (validateUtf8_ && !isValidUtf8(st, en - st))
+      {
+        ++numInvalid_;
+        continue;
+      }
+      line.lineNo = lineNo;
+      line.text = std::string_view(st, en - st);
+      return true;
+    }
+    return false;
+  }
+
+  // Number of lines skipped because they were not valid UTF-8
+  size_t numInvalid() const { return numInvalid_; }
+
+private:
+  const char * p_;
+  const char * end_;
+  size_t lineNo_;
+  bool skipEmpty_;
+  bool validateUtf8_;
+  size_t numInvalid_;
+};
+
+
+// The mapped file and its chunks.
+// Workers call nextChunk() until it returns false. Chunks are claimed in file
+// order and the pages of a chunk are released with doneChunk() once processed
+// so that the resident memory stays bounded regardless of the file size.
+class MappedQueryFile
+{
+public:
+  // Map the file and split it in chunks for numWorkers workers.
+  // Chunks are small enough to give several to each worker so that the load balances
+  // but never exceed maxChunkSz bytes to bound the memory touched by a worker.
+  MappedQueryFile(const std::string & fn, unsigned numWorkers = 1, size_t maxChunkSz = 4 << 20) :
+    data_(0), size_(0), numLines_(0), nextChunk_(0)
+  {
+    int fd = open(fn.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("Could not open " + fn + ": " + strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+      close(fd);
+      throw std::runtime_error("Could not stat " + fn + ": " + strerror(errno));
+    }
+    size_ = st.st_size;
+    if (size_ > 0)
+    {
+      void * p = mmap(0, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED)
+      {
+        close(fd);
+        throw std::runtime_error("Could not map " + fn + ": " + strerror(errno));
+      }
+      data_ = (const char *)p;
+      madvise(p, size_, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    size_t chunkSz = std::min(maxChunkSz, std::max<size_t>(1, size_ / (8 * std::max(1u, numWorkers))));
+    split(chunkSz, std::max(1u, std::thread::hardware_concurrency()));
+  }
+
+  ~MappedQueryFile()
+  {
+    if (data_)
+      munmap((void *)data_, size_);
+  }
+
+  MappedQueryFile(const MappedQueryFile &) = delete;
+  MappedQueryFile & operator=(const MappedQueryFile &) = delete;
+
+  // Claim the next chunk to process. Thread safe.
+  bool nextChunk(QueryChunk & chunk)
+  {
+    size_t idx = nextChunk_.fetch_add(1, std::memory_order_relaxed);
+    if (idx >= chunks_.size())
+      return false;
+    chunk = chunks_[idx];
+    return true;
+  }
+
+  // Indicate that the lines of a chunk are no longer referenced.
+  void doneChunk(const QueryChunk & chunk)
+  {
+    // Only whole pages inside the chunk can be dropped
+    const uintptr_t pgSz = sysconf(_SC_PAGESIZE);
+    uintptr_t st = ((uintptr_t)chunk.begin + pgSz - 1) & ~(pgSz - 1);
+    uintptr_t en = (uintptr_t)chunk.end & ~(pgSz - 1);
+    if (st < en)
+      madvise((void *)st, en - st, MADV_DONTNEED);
+  }
+
+  size_t size() const { return size_; }
+  size_t numChunks() const { return chunks_.size(); }
+  size_t numLines() const { return numLines_; }
+
+private:
+  void split(size_t chunkSz, unsigned numThreads)
+  {
+    // Cut at the first newline following each multiple of the chunk size
+    const char * end = data_ + size_;
+    for (const char * st = data_; st < end; )
+    {
+      const char * en = st + std::min(chunkSz, (size_t)(end - st));
+      if (en < end)
+      {
+        const char * nl = (const char *)memchr(en, '\n', end - en);
+        en = nl ? nl + 1 : end;
+      }
+      QueryChunk chunk = { st, en, 0 };
+      chunks_.push_back(chunk);
+      st = en;
+    }
+
+    // Count the lines of each chunk in parallel and assign the line numbers
+    std::vector<size_t> counts(chunks_.size());
+    std::atomic<size_t> next(0);
+    auto count = [&]() {
+      for (size_t i; (i = next.fetch_add(1)) < chunks_.size(); )
+        counts[i] = countNewlines(chunks_[i].begin, chunks_[i].end);
+    };
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < numThreads && i < chunks_.size(); ++i)
+      threads.emplace_back(count);
+    count();
+    for (std::thread & t : threads)
+      t.join();
+
+    numLines_ = 0;
+    for (size_t i = 0; i < chunks_.size(); ++i)
+    {
+      chunks_[i].firstLineNo = numLines_;
+      numLines_ += counts[i];
+    }
+    if (size_ > 0 && data_[size_ - 1] != '\n')
+      ++numLines_; // last line without terminator
+  }
+
+  const char * data_;
+  size_t size_;
+  size_t numLines_;
+  std::vector<QueryChunk> chunks_;
+  std::atomic<size_t> nextChunk_;
+};
+
+} // namespace idilia
+
+#endif // IDILIA_QUERY_FILE_H
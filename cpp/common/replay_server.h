@@ -0,0 +1,303 @@
+/*
+ * Local HTTP server answering requests with the responses recorded in a trace.
+ *
+ * A request is matched to a record by its path and body; the records with the
+ * same request are served in turn. The fields of url-encoded bodies are matched
+ * in any order since clients encode the parameters in different orders. The response is delayed by the recorded
+ * service time, scaled. Used to replay traces without reaching the services.
+ */
+
+#ifndef IDILIA_REPLAY_SERVER_H
+#define IDILIA_REPLAY_SERVER_H
+
+#include "trace.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace idilia {
+
+
+class ReplayServer
+{
+public:
+  // Listens on an ephemeral port of the loopback interface.
+  // The records must outlive the server.
+  explicit ReplayServer(const std::vector<TraceRecord> & records, double delayScale = 1.0) :
+    delayScale_(delayScale), stop_(false)
+  {
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+      if (!records[i].httpCode)
+        continue;
+      Entry & e = byRequest_[key(pathOf(records[i].url), records[i].body)];
+      e.records.push_back(&records[i]);
+    }
+
+    listenFd_ = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLen = sizeof(addr);
+    if (listenFd_ < 0 || bind(listenFd_, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listenFd_, 1024) != 0 ||
+        getsockname(listenFd_, (sockaddr *)&addr, &addrLen) != 0)
+    {
+      if (listenFd_ >= 0)
+        close(listenFd_);
+      throw std::runtime_error(std::string("Could not listen: ") + strerror(errno));
+    }
+    port_ = ntohs(addr.sin_port);
+    acceptThread_ = std::thread(&ReplayServer::acceptLoop, this);
+  }
+
+  ~ReplayServer()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+      for (size_t i = 0; i < connFds_.size(); ++i)
+        shutdown(connFds_[i], SHUT_RDWR);
+    }
+    shutdown(listenFd_, SHUT_RDWR);
+    acceptThread_.join();
+    close(listenFd_);
+    for (size_t i = 0; i < connThreads_.size(); ++i)
+      connThreads_[i].join();
+  }
+
+  ReplayServer(const ReplayServer &) = delete;
+  ReplayServer & operator=(const ReplayServer &) = delete;
+
+  int port() const { return port_; }
+
+  // The path of a recorded url, e.g. /1/text/disambiguate.xml
+  static std::string_view pathOf(std::string_view url)
+  {
+    size_t p = url.find("://");
+    p = url.find('/', p == std::string_view::npos ? 0 : p + 3);
+    return p == std::string_view::npos ? std::string_view("/") : url.substr(p);
+  }
+
+private:
+  struct Entry
+  {
+    std::vector<const TraceRecord *> records;
+    size_t next = 0; // protected by mutex_
+  };
+
+  static uint64_t key(std::string_view path, std::string_view body)
+  {
+    uint64_t h = 14695981039346656037ULL;
+    auto add = [&h](std::string_view s) {
+      for (size_t i = 0; i < s.length(); ++i)
+        h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+    };
+    add(path);
+    add(std::string_view("\0", 1));
+    if (!isUrlEncoded(body))
+    {
+      add(body);
+      return h;
+    }
+
+    // The fields of a form in sorted order
+    std::vector<std::string_view> fields;
+    for (size_t st = 0, en; st <= body.length(); st = en + 1)
+    {
+      en = std::min(body.find('&', st), body.length());
+      fields.push_back(body.substr(st, en - st));
+    }
+    std::sort(fields.begin(), fields.end());
+    for (size_t i = 0; i < fields.size(); ++i)
+    {
+      add(fields[i]);
+      add("&");
+    }
+    return h;
+  }
+
+  // Whether a body has only the characters of url-encoded fields
+  static bool isUrlEncoded(std::string_view body)
+  {
+    for (size_t i = 0; i < body.length(); ++i)
+    {
+      unsigned char c = body[i];
+      if (!isalnum(c) && !memchr("-._~%&=+*", c, 9))
+        return false;
+    }
+    return !body.empty();
+  }
+
+  void acceptLoop()
+  {
+    for (;;)
+    {
+      int fd = accept(listenFd_, 0, 0);
+      if (fd < 0)
+      {
+        if (errno == EINTR || errno == ECONNABORTED)
+          continue;
+        return;
+      }
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stop_)
+      {
+        close(fd);
+        return;
+      }
+      connFds_.push_back(fd);
+      connThreads_.emplace_back(&ReplayServer::serve, this, fd);
+    }
+  }
+
+  void serve(int fd)
+  {
+    serveRequests(fd);
+    std::lock_guard<std::mutex> lock(mutex_);
+    connFds_.erase(std::find(connFds_.begin(), connFds_.end(), fd));
+    close(fd);
+  }
+
+  // Serve the requests of a keep-alive connection until it is closed
+  void serveRequests(int fd)
+  {
+    std::string in;
+    char buf[16 << 10];
+    for (;;)
+    {
+      // Read the headers then the body given by the Content-Length
+      size_t hdrEnd;
+      while ((hdrEnd = in.find("\r\n\r\n")) == std::string::npos)
+        if (!readMore(fd, in, buf, sizeof(buf)))
+          return;
+      size_t contentLength = 0;
+      bool expectContinue = false;
+      for (size_t p = in.find("\r\n"); p < hdrEnd; p = in.find("\r\n", p + 2))
+        if (strncasecmp(in.c_str() + p + 2, "Content-Length:", 15) == 0)
+          contentLength = strtoul(in.c_str() + p + 17, 0, 10);
+        else if (strncasecmp(in.c_str() + p + 2, "Expect: 100-continue", 20) == 0)
+          expectContinue = true;
+      // curl waits for the interim response before sending a large body
+      static const char continueResp[] = "HTTP/1.1 100 Continue\r\n\r\n";
+      if (expectContinue && in.length() < hdrEnd + 4 + contentLength &&
+          !writeAll(fd, continueResp, sizeof(continueResp) - 1))
+        return;
+      while (in.length() < hdrEnd + 4 + contentLength)
+        if (!readMore(fd, in, buf, sizeof(buf)))
+          return;
+
+      std::string_view req(in);
+      size_t sp1 = req.find(' ');
+      size_t sp2 = req.find(' ', sp1 + 1);
+      std::string_view path = req.substr(sp1 + 1, sp2 - sp1 - 1);
+      if (path.compare(0, 7, "http://") == 0)
+        path = pathOf(path); // sent through a proxy
+      std::string_view body = req.substr(hdrEnd + 4, contentLength);
+
+      const TraceRecord * rec = find(path, body);
+      in.erase(0, hdrEnd + 4 + contentLength);
+
+      if (rec && delayScale_ > 0)
+        std::this_thread::sleep_for(std::chrono::microseconds(uint64_t(rec->serviceUs * delayScale_)));
+
+      static const std::string notFound = "No recorded response for this request";
+      std::string status = rec ? statusLine(rec->httpCode) : "404 Not Found";
+      std::string_view contentType = rec ? std::string_view(rec->contentType) : "text/plain";
+      const std::string & content = rec ? rec->response : notFound;
+      char hdr[512];
+      int hdrLen = snprintf(hdr, sizeof(hdr), "HTTP/1.1 %.*s\r\nContent-Type: %.*s\r\nContent-Length: %zu\r\n\r\n",
+          (int)status.length(), status.data(), (int)contentType.length(), contentType.data(), content.length());
+      if (!writeAll(fd, hdr, hdrLen) || !writeAll(fd, content.data(), content.length()))
+        return;
+    }
+  }
+
+  const TraceRecord * find(std::string_view path, std::string_view body)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unordered_map<uint64_t, Entry>::iterator it = byRequest_.find(key(path, body));
+    if (it == byRequest_.end())
+      return 0;
+    Entry & e = it->second;
+    return e.records[e.next++ % e.records.size()];
+  }
+
+  // The recorded code with its reason phrase. Clients only look at the code.
+  static std::string statusLine(uint32_t httpCode)
+  {
+    switch (httpCode)
+    {
+    case 200: return "200 OK";
+    case 202: return "202 Accepted";
+    case 400: return "400 Bad Request";
+    case 401: return "401 Unauthorized";
+    case 404: return "404 Not Found";
+    case 503: return "503 Service Unavailable";
+    default:  return std::to_string(httpCode) + " Status";
+    }
+  }
+
+  static bool readMore(int fd, std::string & in, char * buf, size_t sz)
+  {
+    ssize_t n;
+    while ((n = read(fd, buf, sz)) < 0 && errno == EINTR)
+      ;
+    if (n <= 0)
+      return false;
+    in.append(buf, n);
+    return true;
+  }
+
+  static bool writeAll(int fd, const char * p, size_t len)
+  {
+    while (len)
+    {
+      ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      p += n;
+      len -= n;
+    }
+    return true;
+  }
+
+  double delayScale_;
+  int listenFd_;
+  int port_;
+  std::mutex mutex_;
+  bool stop_;                                     // protected by mutex_
+  std::unordered_map<uint64_t, Entry> byRequest_; // next protected by mutex_
+  std::vector<int> connFds_;                      // protected by mutex_
+  std::vector<std::thread> connThreads_;          // protected by mutex_
+  std::thread acceptThread_;
+};
+
+} // namespace idilia
+
+#endif // IDILIA_REPLAY_SERVER_H
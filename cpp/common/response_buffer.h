@@ -0,0 +1,335 @@
+/*
+ * Buffer for accumulating the responses downloaded by curl.
+ *
+ * Growing a std::string as the data arrives reallocates and copies the response
+ * several times. Instead, when the server announces the Content-Length, the buffer
+ * reserves a single block of that size in the request's arena. Otherwise, and for
+ * any data exceeding the announced length (e.g. when curl decompresses the
+ * response), it chains fixed-size chunks taken from a per-thread pool.
+ *
+ * The content is read without flattening it through a RopeView over its segments.
+ */
+
+#ifndef IDILIA_RESPONSE_BUFFER_H
+#define IDILIA_RESPONSE_BUFFER_H
+
+#include "arena.h"
+
+#include <curl/curl.h>
+
+#include <strings.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace idilia {
+
+
+// Per-thread pool of the fixed-size chunks used by the response buffers.
+// A chunk released in another thread than the one that obtained it joins the pool of that thread.
+class ChunkPool
+{
+public:
+  static const size_t chunkSz = 64 << 10;
+  static const size_t maxPooled = 64; // chunks kept per thread
+
+  static ChunkPool & local()
+  {
+    static thread_local ChunkPool pool;
+    return pool;
+  }
+
+  char * get()
+  {
+    if (free_.empty())
+    {
+      char * p = (char *)malloc(chunkSz);
+      if (!p)
+        throw std::bad_alloc();
+      return p;
+    }
+    char * p = free_.back();
+    free_.pop_back();
+    return p;
+  }
+
+  void put(char * p)
+  {
+    if (free_.size() < maxPooled)
+      free_.push_back(p);
+    else
+      free(p);
+  }
+
+  ~ChunkPool()
+  {
+    for (size_t i = 0; i < free_.size(); ++i)
+      free(free_[i]);
+  }
+
+private:
+  std::vector<char *> free_;
+};
+
+
+// Read-only view of a range of bytes stored in several segments.
+// Positions are relative to the start of the view.
+class RopeView
+{
+public:
+  RopeView() : segs_(0), offsets_(0), nSegs_(0), begin_(0), end_(0) {}
+  RopeView(const std::string_view * segs, const size_t * offsets, size_t nSegs, size_t begin, size_t end) :
+    segs_(segs), offsets_(offsets), nSegs_(nSegs), begin_(begin), end_(end) {}
+
+  static const size_t npos = std::string_view::npos;
+
+  size_t size() const { return end_ - begin_; }
+  size_t length() const { return size(); }
+  bool empty() const { return end_ == begin_; }
+
+  char operator[](size_t pos) const
+  {
+    size_t abs = begin_ + pos;
+    size_t i = segmentOf(abs);
+    return segs_[i][abs - offsets_[i]];
+  }
+
+  RopeView substr(size_t pos, size_t len = npos) const
+  {
+    pos = std::min(pos, size());
+    len = std::min(len, size() - pos);
+    return RopeView(segs_, offsets_, nSegs_, begin_ + pos, begin_ + pos + len);
+  }
+
+  // Find the first occurrence of pat at or after from.
+  // Matches contained in a segment are found with string_view::find; only the
+  // few positions where a match could straddle two segments are checked byte-wise.
+  size_t find(std::string_view pat, size_t from = 0) const
+  {
+    if (pat.empty())
+      return from <= size() ? from : npos;
+    if (from >= size() || pat.length() > size() - from)
+      return npos;
+    size_t abs = begin_ + from;
+    for (size_t i = segmentOf(abs); i < nSegs_ && offsets_[i] < end_; ++i)
+    {
+      size_t segSt = offsets_[i];
+      std::string_view seg = segs_[i].substr(0, std::min(segs_[i].length(), end_ - segSt));
+      size_t local = seg.find(pat, abs - segSt);
+      if (local != std::string_view::npos)
+        return segSt + local - begin_;
+
+      // Matches starting in the tail of this segment and ending in the following ones
+      size_t segEnd = segSt + seg.length();
+      for (size_t p = std::max(abs, segEnd >= pat.length() ? segEnd - pat.length() + 1 : 0); p < segEnd; ++p)
+      {
+        if (p + pat.length() > end_)
+          return npos;
+        size_t k = 0;
+        while (k < pat.length() && (*this)[p - begin_ + k] == pat[k])
+          ++k;
+        if (k == pat.length())
+          return p - begin_;
+      }
+      abs = segEnd;
+    }
+    return npos;
+  }
+
+  // Call f with each of the contiguous pieces of the view
+  template <class F>
+  void forEachSegment(F f) const
+  {
+    if (empty())
+      return;
+    for (size_t i = segmentOf(begin_); i < nSegs_ && offsets_[i] < end_; ++i)
+    {
+      size_t st = std::max(begin_, offsets_[i]);
+      size_t en = std::min(end_, offsets_[i] + segs_[i].length());
+      f(segs_[i].substr(st - offsets_[i], en - st));
+    }
+  }
+
+  // Returns the view as a single string_view if it is contained in one segment
+  bool contiguous(std::string_view & sv) const
+  {
+    if (empty())
+    {
+      sv = std::string_view();
+      return true;
+    }
+    size_t i = segmentOf(begin_);
+    if (end_ > offsets_[i] + segs_[i].length())
+      return false;
+    sv = segs_[i].substr(begin_ - offsets_[i], size());
+    return true;
+  }
+
+  // Flattened copy. Meant for error messages and small pieces.
+  std::string str() const
+  {
+    std::string s;
+    s.reserve(size());
+    forEachSegment([&s](std::string_view seg) { s.append(seg.data(), seg.length()); });
+    return s;
+  }
+
+private:
+  // Index of the segment containing the absolute position abs
+  size_t segmentOf(size_t abs) const
+  {
+    return std::upper_bound(offsets_, offsets_ + nSegs_, abs) - offsets_ - 1;
+  }
+
+  const std::string_view * segs_;
+  const size_t * offsets_;  // absolute position of the start of each segment
+  size_t nSegs_;
+  size_t begin_;
+  size_t end_;
+};
+
+// Get a contiguous view of the rope, copying it in the arena only if it straddles segments
+inline std::string_view flatten(Arena & arena, const RopeView & rope)
+{
+  std::string_view sv;
+  if (rope.contiguous(sv))
+    return sv;
+  char * p = (char *)arena.allocate(rope.size(), 1);
+  char * o = p;
+  rope.forEachSegment([&o](std::string_view seg) { memcpy(o, seg.data(), seg.length()); o += seg.length(); });
+  return std::string_view(p, rope.size());
+}
+
+inline std::ostream & operator<<(std::ostream & os, const RopeView & rope)
+{
+  rope.forEachSegment([&os](std::string_view seg) { os.write(seg.data(), seg.length()); });
+  return os;
+}
+
+
+// The buffer. Views obtained from it are invalidated when it is appended to.
+class ResponseBuffer
+{
+public:
+  ResponseBuffer(Arena & arena) : arena_(arena), segs_(arena), offsets_(arena), pooled_(arena), size_(0), cap_(0) {}
+  ~ResponseBuffer()
+  {
+    clear();
+  }
+
+  ResponseBuffer(const ResponseBuffer &) = delete;
+  ResponseBuffer & operator=(const ResponseBuffer &) = delete;
+
+  // Reserve a contiguous block for a response of the given length. Only effective when empty.
+  void reserve(size_t len)
+  {
+    if (size_ != 0 || len <= cap_)
+      return;
+    clear();
+    addSegment((char *)arena_.allocate(len, 1), len, false);
+  }
+
+  void append(const char * p, size_t len)
+  {
+    while (len > 0)
+    {
+      if (size_ == cap_)
+        addSegment(ChunkPool::local().get(), ChunkPool::chunkSz, true);
+      std::string_view & seg = segs_.back();
+      size_t n = std::min(len, cap_ - size_);
+      memcpy(const_cast<char *>(seg.data()) + seg.length(), p, n);
+      seg = std::string_view(seg.data(), seg.length() + n);
+      size_ += n;
+      p += n;
+      len -= n;
+    }
+  }
+
+  // Return the chunks to the pool. The arena memory is reclaimed with the arena.
+  void clear()
+  {
+    for (size_t i = 0; i < segs_.size(); ++i)
+      if (pooled_[i])
+        ChunkPool::local().put(const_cast<char *>(segs_[i].data()));
+    segs_.clear();
+    offsets_.clear();
+    pooled_.clear();
+    size_ = cap_ = 0;
+  }
+
+  size_t size() const { return size_; }
+  size_t length() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  size_t numSegments() const { return segs_.size(); }
+
+  RopeView view() const
+  {
+    return RopeView(segs_.data(), offsets_.data(), segs_.size(), 0, size_);
+  }
+
+  std::string str() const { return view().str(); }
+
+  // Curl helper function for storing the response downloaded from the server
+  static size_t writeCallback(void *ptr, size_t size, size_t nmeb, void *stream)
+  {
+    ResponseBuffer & buffer = *((ResponseBuffer *) stream);
+    size_t readSz = size * nmeb;
+    buffer.append((const char *)ptr, readSz);
+    return readSz;
+  }
+
+  // Curl helper function receiving the response headers to size the buffer from the Content-Length
+  static size_t headerCallback(char *ptr, size_t size, size_t nmeb, void *stream)
+  {
+    ResponseBuffer & buffer = *((ResponseBuffer *) stream);
+    size_t readSz = size * nmeb;
+    static const char hdr[] = "content-length:";
+    if (readSz > sizeof(hdr) && strncasecmp(ptr, hdr, sizeof(hdr) - 1) == 0)
+    {
+      char * end;
+      unsigned long long len = strtoull(std::string(ptr + sizeof(hdr) - 1, readSz - sizeof(hdr) + 1).c_str(), &end, 10);
+      if (len > 0 && len < (1ULL << 32))
+        buffer.reserve(len);
+    }
+    return readSz;
+  }
+
+  // Configure the curl handle to download the response in this buffer
+  void setup(CURL * curl)
+  {
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &ResponseBuffer::writeCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, this);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, &ResponseBuffer::headerCallback);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, this);
+  }
+
+private:
+  void addSegment(char * p, size_t cap, bool pooled)
+  {
+    segs_.push_back(std::string_view(p, 0));
+    offsets_.push_back(size_);
+    pooled_.push_back(pooled);
+    cap_ += cap;
+  }
+
+  Arena & arena_;
+  ArenaVector<std::string_view> segs_; // the filled part of each segment
+  ArenaVector<size_t> offsets_;
+  ArenaVector<bool> pooled_;
+  size_t size_;
+  size_t cap_;
+};
+
+inline std::ostream & operator<<(std::ostream & os, const ResponseBuffer & buf)
+{
+  return os << buf.view();
+}
+
+} // namespace idilia
+
+#endif // IDILIA_RESPONSE_BUFFER_H
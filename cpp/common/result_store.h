@@ -0,0 +1,966 @@
+/*
+ * Persistent store of disambiguation results.
+ *
+ * Writing one file per query makes finding "all the queries resolved to sense X"
+ * a reparse of every file. Instead the results are appended to segment files:
+ *
+ *   <seq>.dat  compressed blocks of records (input id, senses found, payload)
+ *   <seq>.idx  the records' locations sorted by input id, mapped and binary searched
+ *   <seq>.inv  for each sense id, the sorted input ids of the records with that sense
+ *   senses.txt the sense keys in the order of their ids
+ *   MANIFEST   the live segments in write order and the segment being written
+ *
+ * Records are appended to the active segment which is sealed (its .idx and .inv
+ * written) when it reaches a size. Readers work on a snapshot of the segment list
+ * and never block on sealing or compaction. A background thread merges adjacent
+ * segments to keep their number bounded, dropping the records that were rewritten.
+ * When an input id is written again, the latest record wins.
+ *
+ * Requires zlib.
+ */
+
+#ifndef IDILIA_RESULT_STORE_H
+#define IDILIA_RESULT_STORE_H
+
+#include "senses.h"
+
+#include <zlib.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace idilia {
+
+
+// A result as stored. The sense ids are those of the store's dictionary.
+struct StoredResult
+{
+  uint64_t inputId;
+  CompactSenses senses;
+  std::string payload; // e.g. the semdoc
+};
+
+
+namespace store_detail {
+
+const uint32_t blockMagic = 0x4b4c4449; // "IDLK"
+
+struct BlockHeader
+{
+  uint32_t magic;
+  uint32_t rawLen;
+  uint32_t compLen;
+  uint32_t crc;     // of the compressed data
+};
+
+// Location of a record. Stored as is in the .idx files.
+struct IndexEntry
+{
+  uint64_t inputId;
+  uint64_t blockOff; // offset of the block in the .dat file
+  uint32_t recOff;   // offset of the record in the uncompressed block
+  uint32_t pad;
+};
+
+// Entry of a .inv file. The postings follow the entries.
+struct InvEntry
+{
+  uint32_t senseId;
+  uint32_t count;
+  uint64_t first; // index of the first posting
+};
+
+inline std::string segmentPath(const std::string & dir, uint64_t seq, const char * ext)
+{
+  char name[32];
+  snprintf(name, sizeof(name), "/%08llu.%s", (unsigned long long)seq, ext);
+  return dir + name;
+}
+
+inline void throwErrno(const std::string & what, const std::string & fn)
+{
+  throw std::runtime_error(what + ' ' + fn + ": " + strerror(errno));
+}
+
+inline void writeAll(int fd, const void * p, size_t len, const std::string & fn)
+{
+  for (const char * c = (const char *)p; len > 0; )
+  {
+    ssize_t n = write(fd, c, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      throwErrno("Could not write", fn);
+    c += n;
+    len -= n;
+  }
+}
+
+// Write at an offset, whatever the offset of the file
+inline void writeAllAt(int fd, const void * p, size_t len, uint64_t off, const std::string & fn)
+{
+  for (const char * c = (const char *)p; len > 0; )
+  {
+    ssize_t n = pwrite(fd, c, len, off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      throwErrno("Could not write", fn);
+    c += n;
+    len -= n;
+    off += n;
+  }
+}
+
+inline bool readAll(int fd, void * p, size_t len, uint64_t off)
+{
+  for (char * c = (char *)p; len > 0; )
+  {
+    ssize_t n = pread(fd, c, len, off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    c += n;
+    len -= n;
+    off += n;
+  }
+  return true;
+}
+
+// Write a file under a temporary name then rename it so that it is never seen partially written
+inline void writeFileAtomically(const std::string & fn, const std::function<void(int fd)> & writer)
+{
+  std::string tmp = fn + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    throwErrno("Could not create", tmp);
+  try
+  {
+    writer(fd);
+  }
+  catch (...)
+  {
+    close(fd);
+    throw;
+  }
+  if (fdatasync(fd) != 0 || close(fd) != 0)
+    throwErrno("Could not write", tmp);
+  if (rename(tmp.c_str(), fn.c_str()) != 0)
+    throwErrno("Could not rename", tmp);
+}
+
+// Serialized record: id, number of senses, payload length, senses, payload
+inline void appendRecord(std::string & block, uint64_t inputId, const CompactSenses & senses, std::string_view payload)
+{
+  uint32_t hdr[2] = {(uint32_t)senses.size(), (uint32_t)payload.length()};
+  block.append((const char *)&inputId, sizeof(inputId));
+  block.append((const char *)hdr, sizeof(hdr));
+  block.append((const char *)senses.data(), senses.size() * sizeof(SenseOccurrence));
+  block.append(payload.data(), payload.length());
+}
+
+// Parse the record at p. Returns its size or 0 if it overflows end.
+inline size_t parseRecord(const char * p, const char * end, StoredResult * out)
+{
+  const size_t hdrSz = sizeof(uint64_t) + 2 * sizeof(uint32_t);
+  if (end - p < (ptrdiff_t)hdrSz)
+    return 0;
+  uint64_t inputId;
+  uint32_t hdr[2];
+  memcpy(&inputId, p, sizeof(inputId));
+  memcpy(hdr, p + sizeof(inputId), sizeof(hdr));
+  size_t sz = hdrSz + (size_t)hdr[0] * sizeof(SenseOccurrence) + hdr[1];
+  if ((size_t)(end - p) < sz)
+    return 0;
+  if (out)
+  {
+    out->inputId = inputId;
+    out->senses.resize(hdr[0]);
+    memcpy(out->senses.data(), p + hdrSz, hdr[0] * sizeof(SenseOccurrence));
+    out->payload.assign(p + hdrSz + hdr[0] * sizeof(SenseOccurrence), hdr[1]);
+  }
+  return sz;
+}
+
+// Read and decompress the block at off. Returns false if missing or corrupt.
+// hdr receives the header to let the caller find the next block.
+inline bool readBlock(int fd, uint64_t off, std::string & raw, BlockHeader & hdr)
+{
+  if (!readAll(fd, &hdr, sizeof(hdr), off) || hdr.magic != blockMagic)
+    return false;
+  std::string comp(hdr.compLen, '\0');
+  if (!readAll(fd, &comp[0], hdr.compLen, off + sizeof(hdr)))
+    return false;
+  if (crc32(0, (const Bytef *)comp.data(), comp.length()) != hdr.crc)
+    return false;
+  raw.resize(hdr.rawLen);
+  uLongf rawLen = hdr.rawLen;
+  return uncompress((Bytef *)&raw[0], &rawLen, (const Bytef *)comp.data(), comp.length()) == Z_OK && rawLen == hdr.rawLen;
+}
+
+
+// A read-only mapping of a whole file
+class MappedFile
+{
+public:
+  explicit MappedFile(const std::string & fn) : data_(0), size_(0)
+  {
+    int fd = open(fn.c_str(), O_RDONLY);
+    if (fd < 0)
+      throwErrno("Could not open", fn);
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+      close(fd);
+      throwErrno("Could not stat", fn);
+    }
+    size_ = st.st_size;
+    if (size_ > 0)
+    {
+      void * p = mmap(0, size_, PROT_READ, MAP_SHARED, fd, 0);
+      if (p == MAP_FAILED)
+      {
+        close(fd);
+        throwErrno("Could not map", fn);
+      }
+      data_ = (const char *)p;
+    }
+    close(fd);
+  }
+
+  ~MappedFile()
+  {
+    if (data_)
+      munmap((void *)data_, size_);
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile & operator=(const MappedFile &) = delete;
+
+  const char * data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  const char * data_;
+  size_t size_;
+};
+
+
+// A segment being written. Used for the active segment and for the output of compaction.
+// Readers may look up records while it is appended to.
+class SegmentWriter
+{
+public:
+  typedef std::function<void()> BeforeWriteFn;
+
+  SegmentWriter(const std::string & dir, uint64_t seq, size_t blockSz, int level, BeforeWriteFn beforeWrite) :
+    dir_(dir), seq_(seq), blockSz_(blockSz), level_(level), beforeWrite_(beforeWrite), fileSz_(0), rawSz_(0), overwrites_(false)
+  {
+    std::string fn = segmentPath(dir, seq, "dat");
+    fd_ = open(fn.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd_ < 0)
+      throwErrno("Could not open", fn);
+  }
+
+  ~SegmentWriter()
+  {
+    close(fd_);
+  }
+
+  SegmentWriter(const SegmentWriter &) = delete;
+  SegmentWriter & operator=(const SegmentWriter &) = delete;
+
+  // Reload the blocks written before a restart. A partially written block is truncated.
+  // inOlder tells if an input id is in the older segments.
+  void recover(const std::function<bool(uint64_t)> & inOlder)
+  {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    std::string raw;
+    BlockHeader hdr;
+    while (readBlock(fd_, fileSz_, raw, hdr))
+    {
+      for (size_t off = 0, sz; off < raw.length(); off += sz)
+      {
+        StoredResult res;
+        sz = parseRecord(raw.data() + off, raw.data() + raw.length(), &res);
+        if (sz == 0)
+          break;
+        addEntry(res.inputId, res.senses, fileSz_, off);
+        if (!overwrites_ && inOlder(res.inputId))
+          overwrites_ = true;
+      }
+      fileSz_ += sizeof(hdr) + hdr.compLen;
+      rawSz_ += hdr.rawLen;
+    }
+    if (ftruncate(fd_, fileSz_) != 0)
+      throwErrno("Could not truncate", segmentPath(dir_, seq_, "dat"));
+  }
+
+  void append(uint64_t inputId, const CompactSenses & senses, std::string_view payload)
+  {
+    {
+      std::unique_lock<std::shared_mutex> lock(mutex_);
+      addEntry(inputId, senses, fileSz_, block_.length());
+      appendRecord(block_, inputId, senses, payload);
+    }
+    if (block_.length() >= blockSz_)
+      flushBlock();
+  }
+
+  // Compress and write the current block
+  void flushBlock()
+  {
+    if (block_.empty())
+      return;
+    if (beforeWrite_)
+      beforeWrite_();
+
+    std::string comp(compressBound(block_.length()), '\0');
+    uLongf compLen = comp.length();
+    if (compress2((Bytef *)&comp[0], &compLen, (const Bytef *)block_.data(), block_.length(), level_) != Z_OK)
+      throw std::runtime_error("Could not compress block");
+    BlockHeader hdr = {blockMagic, (uint32_t)block_.length(), (uint32_t)compLen, (uint32_t)crc32(0, (const Bytef *)comp.data(), compLen)};
+    // At the end of the blocks: the file is reopened after a restart and read with pread
+    std::string fn = segmentPath(dir_, seq_, "dat");
+    writeAllAt(fd_, &hdr, sizeof(hdr), fileSz_, fn);
+    writeAllAt(fd_, comp.data(), compLen, fileSz_ + sizeof(hdr), fn);
+
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    fileSz_ += sizeof(hdr) + compLen;
+    rawSz_ += block_.length();
+    block_.clear();
+  }
+
+  void sync()
+  {
+    if (fdatasync(fd_) != 0)
+      throwErrno("Could not sync", segmentPath(dir_, seq_, "dat"));
+  }
+
+  // Write the index files of the segment once all the records have been appended
+  void seal()
+  {
+    flushBlock();
+    sync();
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+
+    // Offset index of the latest record of each input id
+    std::vector<IndexEntry> idx;
+    idx.reserve(latest_.size());
+    for (auto it = latest_.begin(); it != latest_.end(); ++it)
+      idx.push_back(entries_[it->second]);
+    std::sort(idx.begin(), idx.end(), [](const IndexEntry & a, const IndexEntry & b) { return a.inputId < b.inputId; });
+    writeFileAtomically(segmentPath(dir_, seq_, "idx"), [&](int fd) {
+      writeAll(fd, idx.data(), idx.size() * sizeof(IndexEntry), segmentPath(dir_, seq_, "idx"));
+    });
+
+    // Inverted index
+    std::vector<InvEntry> inv;
+    std::vector<uint64_t> postings;
+    std::vector<uint32_t> senseIds;
+    for (auto it = postings_.begin(); it != postings_.end(); ++it)
+      senseIds.push_back(it->first);
+    std::sort(senseIds.begin(), senseIds.end());
+    for (size_t i = 0; i < senseIds.size(); ++i)
+    {
+      size_t first = postings.size();
+      const std::vector<uint32_t> & recs = postings_.find(senseIds[i])->second;
+      for (size_t j = 0; j < recs.size(); ++j)
+        if (isLatest(recs[j]))
+          postings.push_back(entries_[recs[j]].inputId);
+      std::sort(postings.begin() + first, postings.end());
+      postings.erase(std::unique(postings.begin() + first, postings.end()), postings.end());
+      if (postings.size() > first)
+        inv.push_back(InvEntry{senseIds[i], (uint32_t)(postings.size() - first), first});
+    }
+    writeFileAtomically(segmentPath(dir_, seq_, "inv"), [&](int fd) {
+      uint64_t n = inv.size();
+      std::string fn = segmentPath(dir_, seq_, "inv");
+      writeAll(fd, &n, sizeof(n), fn);
+      writeAll(fd, inv.data(), inv.size() * sizeof(InvEntry), fn);
+      writeAll(fd, postings.data(), postings.size() * sizeof(uint64_t), fn);
+    });
+  }
+
+  bool contains(uint64_t inputId) const
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return latest_.count(inputId) != 0;
+  }
+
+  bool get(uint64_t inputId, StoredResult & out) const
+  {
+    std::string raw;
+    uint32_t recOff;
+    {
+      std::shared_lock<std::shared_mutex> lock(mutex_);
+      auto it = latest_.find(inputId);
+      if (it == latest_.end())
+        return false;
+      const IndexEntry & e = entries_[it->second];
+      recOff = e.recOff;
+      if (e.blockOff == fileSz_)
+        raw = block_; // not written yet
+      else
+      {
+        BlockHeader hdr;
+        if (!readBlock(fd_, e.blockOff, raw, hdr))
+          throw std::runtime_error("Corrupt block in " + segmentPath(dir_, seq_, "dat"));
+      }
+    }
+    return parseRecord(raw.data() + recOff, raw.data() + raw.length(), &out) != 0;
+  }
+
+  // Call f(inputId) for the latest record of each input id with the sense
+  template <class F>
+  void forEachWithSense(uint32_t senseId, F f) const
+  {
+    std::vector<uint64_t> ids;
+    {
+      std::shared_lock<std::shared_mutex> lock(mutex_);
+      auto it = postings_.find(senseId);
+      if (it == postings_.end())
+        return;
+      for (size_t i = 0; i < it->second.size(); ++i)
+        if (isLatest(it->second[i]))
+          ids.push_back(entries_[it->second[i]].inputId);
+    }
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    for (size_t i = 0; i < ids.size(); ++i)
+      f(ids[i]);
+  }
+
+  uint64_t seq() const { return seq_; }
+  size_t rawSize() const { return rawSz_ + block_.length(); }
+
+  // Whether it contains input ids also present in older segments
+  bool overwrites() const { return overwrites_; }
+  void setOverwrites() { overwrites_ = true; }
+
+private:
+  // Called with the exclusive lock held
+  void addEntry(uint64_t inputId, const CompactSenses & senses, uint64_t blockOff, size_t recOff)
+  {
+    uint32_t idx = entries_.size();
+    entries_.push_back(IndexEntry{inputId, blockOff, (uint32_t)recOff, 0});
+    latest_[inputId] = idx;
+    for (size_t i = 0; i < senses.size(); ++i)
+    {
+      std::vector<uint32_t> & recs = postings_[senses[i].senseId];
+      if (recs.empty() || recs.back() != idx)
+        recs.push_back(idx);
+    }
+  }
+
+  bool isLatest(uint32_t idx) const
+  {
+    return latest_.find(entries_[idx].inputId)->second == idx;
+  }
+
+  std::string dir_;
+  uint64_t seq_;
+  size_t blockSz_;
+  int level_;
+  BeforeWriteFn beforeWrite_;
+  int fd_;
+
+  mutable std::shared_mutex mutex_;      // protects the members below against readers
+  uint64_t fileSz_;                      // the current block will be written at this offset
+  size_t rawSz_;
+  std::string block_;
+  std::vector<IndexEntry> entries_;
+  std::unordered_map<uint64_t, uint32_t> latest_;                  // input id -> entry
+  std::unordered_map<uint32_t, std::vector<uint32_t> > postings_;  // sense id -> entries
+  std::atomic<bool> overwrites_;
+};
+
+
+// A sealed segment. Immutable; its index files are mapped.
+class Segment
+{
+public:
+  Segment(const std::string & dir, uint64_t seq, bool overwrites) :
+    dir_(dir), seq_(seq), overwrites_(overwrites),
+    idx_(segmentPath(dir, seq, "idx")), inv_(segmentPath(dir, seq, "inv")), unlink_(false)
+  {
+    std::string fn = segmentPath(dir, seq, "dat");
+    fd_ = open(fn.c_str(), O_RDONLY);
+    if (fd_ < 0)
+      throwErrno("Could not open", fn);
+    struct stat st;
+    fstat(fd_, &st);
+    dataSz_ = st.st_size;
+
+    entries_ = (const IndexEntry *)idx_.data();
+    numEntries_ = idx_.size() / sizeof(IndexEntry);
+    uint64_t n = 0;
+    if (inv_.size() >= sizeof(n))
+      memcpy(&n, inv_.data(), sizeof(n));
+    invEntries_ = (const InvEntry *)(inv_.data() + sizeof(n));
+    numInv_ = n;
+    postings_ = (const uint64_t *)(invEntries_ + n);
+  }
+
+  // Files of a segment replaced by compaction are removed once no reader uses it
+  ~Segment()
+  {
+    close(fd_);
+    if (unlink_)
+    {
+      unlink(segmentPath(dir_, seq_, "dat").c_str());
+      unlink(segmentPath(dir_, seq_, "idx").c_str());
+      unlink(segmentPath(dir_, seq_, "inv").c_str());
+    }
+  }
+
+  Segment(const Segment &) = delete;
+  Segment & operator=(const Segment &) = delete;
+
+  bool contains(uint64_t inputId) const
+  {
+    return find(inputId) != 0;
+  }
+
+  bool get(uint64_t inputId, StoredResult & out) const
+  {
+    const IndexEntry * e = find(inputId);
+    if (!e)
+      return false;
+    std::string raw;
+    BlockHeader hdr;
+    if (!readBlock(fd_, e->blockOff, raw, hdr))
+      throw std::runtime_error("Corrupt block in " + segmentPath(dir_, seq_, "dat"));
+    return parseRecord(raw.data() + e->recOff, raw.data() + raw.length(), &out) != 0;
+  }
+
+  // The sorted input ids of the records with the sense
+  std::pair<const uint64_t *, size_t> postings(uint32_t senseId) const
+  {
+    const InvEntry * it = std::lower_bound(invEntries_, invEntries_ + numInv_, senseId,
+        [](const InvEntry & e, uint32_t id) { return e.senseId < id; });
+    if (it == invEntries_ + numInv_ || it->senseId != senseId)
+      return std::make_pair((const uint64_t *)0, (size_t)0);
+    return std::make_pair(postings_ + it->first, (size_t)it->count);
+  }
+
+  // Call f(const StoredResult &) for each record in file order, including the ones rewritten in the segment
+  template <class F>
+  void forEachRecord(F f) const
+  {
+    std::string raw;
+    BlockHeader hdr;
+    StoredResult res;
+    for (uint64_t off = 0; off < dataSz_ && readBlock(fd_, off, raw, hdr); off += sizeof(hdr) + hdr.compLen)
+    {
+      for (size_t pos = 0, sz; pos < raw.length(); pos += sz)
+      {
+        if ((sz = parseRecord(raw.data() + pos, raw.data() + raw.length(), &res)) == 0)
+          break;
+        f(res);
+      }
+    }
+  }
+
+  uint64_t seq() const { return seq_; }
+  bool overwrites() const { return overwrites_; }
+  size_t dataSize() const { return dataSz_; }
+  size_t numRecords() const { return numEntries_; }
+  void unlinkWhenUnused() { unlink_ = true; }
+
+private:
+  const IndexEntry * find(uint64_t inputId) const
+  {
+    const IndexEntry * it = std::lower_bound(entries_, entries_ + numEntries_, inputId,
+        [](const IndexEntry & e, uint64_t id) { return e.inputId < id; });
+    return it != entries_ + numEntries_ && it->inputId == inputId ? it : 0;
+  }
+
+  std::string dir_;
+  uint64_t seq_;
+  bool overwrites_;
+  int fd_;
+  size_t dataSz_;
+  MappedFile idx_;
+  MappedFile inv_;
+  const IndexEntry * entries_;
+  size_t numEntries_;
+  const InvEntry * invEntries_;
+  size_t numInv_;
+  const uint64_t * postings_;
+  std::atomic<bool> unlink_;
+};
+
+} // namespace store_detail
+
+
+class ResultStore
+{
+public:
+  struct Options
+  {
+    Options() : blockSz(64 << 10), segmentSz(64 << 20), maxSegments(8), compressionLevel(Z_BEST_SPEED) {}
+    size_t blockSz;        // uncompressed size of the blocks
+    size_t segmentSz;      // uncompressed size at which the active segment is sealed
+    size_t maxSegments;    // compaction keeps the number of sealed segments under this
+    int compressionLevel;
+  };
+
+  // Open or create the store in an existing directory
+  ResultStore(const std::string & dir, const Options & opts = Options()) :
+    dir_(dir), opts_(opts), nextSeq_(1), persistedSenses_(0), stop_(false)
+  {
+    std::shared_ptr<Snapshot> snap = std::make_shared<Snapshot>();
+    uint64_t activeSeq = 0;
+    std::vector<std::pair<uint64_t, bool> > live;
+    std::ifstream manifest((dir_ + "/MANIFEST").c_str());
+    for (std::string kind; manifest >> kind; )
+    {
+      uint64_t seq;
+      manifest >> seq;
+      if (kind == "next")
+        nextSeq_ = seq;
+      else if (kind == "active")
+        activeSeq = seq;
+      else if (kind == "segment")
+      {
+        int overwrites;
+        manifest >> overwrites;
+        live.push_back(std::make_pair(seq, overwrites != 0));
+      }
+    }
+
+    loadDictionary();
+    for (size_t i = 0; i < live.size(); ++i)
+      snap->sealed.push_back(std::make_shared<store_detail::Segment>(dir_, live[i].first, live[i].second));
+    removeUnlistedFiles(live, activeSeq);
+
+    if (activeSeq != 0)
+    {
+      snap->active = newWriter(activeSeq);
+      snap->active->recover([&snap](uint64_t inputId) {
+        for (size_t i = 0; i < snap->sealed.size(); ++i)
+          if (snap->sealed[i]->contains(inputId))
+            return true;
+        return false;
+      });
+    }
+    else
+      snap->active = newWriter(nextSeq_++);
+    snapshot_ = snap;
+    writeManifest(*snap);
+
+    compactor_ = std::thread(&ResultStore::compactLoop, this);
+  }
+
+  // Writes the pending records. They are recovered when the store is reopened.
+  ~ResultStore()
+  {
+    {
+      std::lock_guard<std::mutex> lock(compactMutex_);
+      stop_ = true;
+    }
+    compactCond_.notify_all();
+    compactor_.join();
+    flush();
+  }
+
+  ResultStore(const ResultStore &) = delete;
+  ResultStore & operator=(const ResultStore &) = delete;
+
+  // The dictionary of the sense ids of the results
+  SenseKeyDictionary & dictionary() { return dict_; }
+
+  // Append the result for an input. Replaces any previous result for the same input.
+  // Thread safe; the writers are serialized.
+  void put(uint64_t inputId, const CompactSenses & senses, std::string_view payload)
+  {
+    std::lock_guard<std::mutex> lock(writeMutex_);
+    std::shared_ptr<Snapshot> snap = snapshot();
+    if (!snap->active->overwrites())
+    {
+      for (size_t i = 0; i < snap->sealed.size(); ++i)
+        if (snap->sealed[i]->contains(inputId))
+          snap->active->setOverwrites();
+    }
+    snap->active->append(inputId, senses, payload);
+    if (snap->active->rawSize() >= opts_.segmentSz)
+      seal(snap);
+  }
+
+  // Make the results appended so far durable
+  void flush()
+  {
+    std::lock_guard<std::mutex> lock(writeMutex_);
+    std::shared_ptr<Snapshot> snap = snapshot();
+    snap->active->flushBlock();
+    snap->active->sync();
+  }
+
+  // Get the latest result of an input. Thread safe.
+  bool get(uint64_t inputId, StoredResult & out) const
+  {
+    std::shared_ptr<Snapshot> snap = snapshot();
+    if (snap->active->get(inputId, out))
+      return true;
+    for (size_t i = snap->sealed.size(); i-- > 0; )
+      if (snap->sealed[i]->get(inputId, out))
+        return true;
+    return false;
+  }
+
+  // Call f(uint64_t inputId) for each input whose latest result has the sense. Thread safe.
+  // The ids are in increasing order within each segment, segments oldest first.
+  template <class F>
+  void forEachWithSense(std::string_view sk, F f) const
+  {
+    uint32_t senseId = dict_.findSense(sk);
+    if (senseId == SenseKeyDictionary::npos)
+      return;
+    std::shared_ptr<Snapshot> snap = snapshot();
+    for (size_t i = 0; i < snap->sealed.size(); ++i)
+    {
+      // Only the newer segments containing rewritten inputs can supersede a record
+      std::vector<const store_detail::Segment *> newer;
+      for (size_t j = i + 1; j < snap->sealed.size(); ++j)
+        if (snap->sealed[j]->overwrites())
+          newer.push_back(snap->sealed[j].get());
+      bool activeOverwrites = snap->active->overwrites();
+
+      std::pair<const uint64_t *, size_t> ids = snap->sealed[i]->postings(senseId);
+      for (size_t k = 0; k < ids.second; ++k)
+      {
+        bool superseded = activeOverwrites && snap->active->contains(ids.first[k]);
+        for (size_t j = 0; !superseded && j < newer.size(); ++j)
+          superseded = newer[j]->contains(ids.first[k]);
+        if (!superseded)
+          f(ids.first[k]);
+      }
+    }
+    snap->active->forEachWithSense(senseId, f);
+  }
+
+  size_t countWithSense(std::string_view sk) const
+  {
+    size_t count = 0;
+    forEachWithSense(sk, [&count](uint64_t) { ++count; });
+    return count;
+  }
+
+  size_t numSegments() const
+  {
+    return snapshot()->sealed.size() + 1;
+  }
+
+private:
+  struct Snapshot
+  {
+    std::vector<std::shared_ptr<store_detail::Segment> > sealed; // oldest first
+    std::shared_ptr<store_detail::SegmentWriter> active;
+  };
+
+  std::shared_ptr<Snapshot> snapshot() const
+  {
+    std::lock_guard<std::mutex> lock(snapMutex_);
+    return snapshot_;
+  }
+
+  std::shared_ptr<store_detail::SegmentWriter> newWriter(uint64_t seq)
+  {
+    return std::make_shared<store_detail::SegmentWriter>(dir_, seq, opts_.blockSz, opts_.compressionLevel,
+        [this] { persistDictionary(); });
+  }
+
+  // Called with writeMutex_ held
+  void seal(std::shared_ptr<Snapshot> snap)
+  {
+    snap->active->seal();
+    std::shared_ptr<store_detail::Segment> sealed = std::make_shared<store_detail::Segment>(
+        dir_, snap->active->seq(), snap->active->overwrites());
+    std::shared_ptr<store_detail::SegmentWriter> active = newWriter(nextSeq_++);
+    {
+      std::lock_guard<std::mutex> lock(snapMutex_);
+      std::shared_ptr<Snapshot> next = std::make_shared<Snapshot>(*snapshot_);
+      next->sealed.push_back(sealed);
+      next->active = active;
+      writeManifest(*next);
+      snapshot_ = next;
+    }
+    {
+      std::lock_guard<std::mutex> lock(compactMutex_); // not lost if the compactor is checking
+    }
+    compactCond_.notify_all();
+  }
+
+  // Merge adjacent segments while there are too many. The smallest pair is merged first
+  // so that the data is rewritten a logarithmic number of times.
+  void compactLoop()
+  {
+    for (;;)
+    {
+      {
+        std::unique_lock<std::mutex> lock(compactMutex_);
+        compactCond_.wait(lock, [this] { return stop_ || snapshot()->sealed.size() > opts_.maxSegments; });
+        if (stop_)
+          return;
+      }
+      std::shared_ptr<Snapshot> snap = snapshot();
+      size_t best = 0;
+      for (size_t i = 1; i + 1 < snap->sealed.size(); ++i)
+        if (snap->sealed[i]->dataSize() + snap->sealed[i + 1]->dataSize() <
+            snap->sealed[best]->dataSize() + snap->sealed[best + 1]->dataSize())
+          best = i;
+      try
+      {
+        merge(snap->sealed[best], snap->sealed[best + 1]);
+      }
+      catch (const std::exception & e)
+      {
+        // Retry later. The store stays usable with more segments.
+        fprintf(stderr, "Compaction of %s failed: %s\n", dir_.c_str(), e.what());
+        std::unique_lock<std::mutex> lock(compactMutex_);
+        compactCond_.wait_for(lock, std::chrono::seconds(10), [this] { return stop_; });
+      }
+    }
+  }
+
+  void merge(std::shared_ptr<store_detail::Segment> older, std::shared_ptr<store_detail::Segment> newer)
+  {
+    uint64_t seq = nextSeq_++;
+    store_detail::SegmentWriter out(dir_, seq, opts_.blockSz, opts_.compressionLevel, store_detail::SegmentWriter::BeforeWriteFn());
+    older->forEachRecord([&](const StoredResult & res) {
+      if (!newer->contains(res.inputId))
+        out.append(res.inputId, res.senses, res.payload);
+    });
+    newer->forEachRecord([&](const StoredResult & res) {
+      out.append(res.inputId, res.senses, res.payload);
+    });
+    out.seal();
+    std::shared_ptr<store_detail::Segment> merged = std::make_shared<store_detail::Segment>(
+        dir_, seq, older->overwrites() || newer->overwrites());
+
+    std::lock_guard<std::mutex> lock(snapMutex_);
+    std::shared_ptr<Snapshot> next = std::make_shared<Snapshot>(*snapshot_);
+    for (size_t i = 0; i + 1 < next->sealed.size(); ++i)
+    {
+      if (next->sealed[i] == older && next->sealed[i + 1] == newer)
+      {
+        next->sealed[i] = merged;
+        next->sealed.erase(next->sealed.begin() + i + 1);
+        break;
+      }
+    }
+    writeManifest(*next);
+    snapshot_ = next;
+    older->unlinkWhenUnused();
+    newer->unlinkWhenUnused();
+  }
+
+  // Called with snapMutex_ held or before the store is shared
+  void writeManifest(const Snapshot & snap)
+  {
+    std::string content;
+    content += "next " + std::to_string(nextSeq_) + "\n";
+    content += "active " + std::to_string(snap.active->seq()) + "\n";
+    for (size_t i = 0; i < snap.sealed.size(); ++i)
+      content += "segment " + std::to_string(snap.sealed[i]->seq()) + ' ' + (snap.sealed[i]->overwrites() ? "1" : "0") + "\n";
+    store_detail::writeFileAtomically(dir_ + "/MANIFEST", [&](int fd) {
+      store_detail::writeAll(fd, content.data(), content.length(), dir_ + "/MANIFEST");
+    });
+  }
+
+  // Remove the files left by an interrupted compaction or seal
+  void removeUnlistedFiles(const std::vector<std::pair<uint64_t, bool> > & live, uint64_t activeSeq)
+  {
+    DIR * d = opendir(dir_.c_str());
+    if (!d)
+      store_detail::throwErrno("Could not open", dir_);
+    for (struct dirent * ent; (ent = readdir(d)); )
+    {
+      char * end;
+      unsigned long long seq = strtoull(ent->d_name, &end, 10);
+      if (end == ent->d_name || *end != '.')
+        continue;
+      bool listed = seq == activeSeq && strcmp(end, ".dat") == 0;
+      for (size_t i = 0; !listed && i < live.size(); ++i)
+        listed = live[i].first == seq && strstr(end, ".tmp") == 0;
+      if (!listed)
+        unlink((dir_ + '/' + ent->d_name).c_str());
+    }
+    closedir(d);
+  }
+
+  void loadDictionary()
+  {
+    std::ifstream is((dir_ + "/senses.txt").c_str());
+    for (std::string sk; getline(is, sk); ++persistedSenses_)
+      if (dict_.senseId(sk) != persistedSenses_)
+        throw std::runtime_error("Duplicate sense key in " + dir_ + "/senses.txt: " + sk);
+  }
+
+  // Append the new sense keys. Done before writing the records that refer to them.
+  void persistDictionary()
+  {
+    std::lock_guard<std::mutex> lock(dictMutex_);
+    size_t n = dict_.numSenses();
+    if (n == persistedSenses_)
+      return;
+    std::string content;
+    for (size_t i = persistedSenses_; i < n; ++i)
+      content += dict_.senseKey(i) + '\n';
+    std::string fn = dir_ + "/senses.txt";
+    int fd = open(fn.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+      store_detail::throwErrno("Could not open", fn);
+    store_detail::writeAll(fd, content.data(), content.length(), fn);
+    fdatasync(fd);
+    close(fd);
+    persistedSenses_ = n;
+  }
+
+  std::string dir_;
+  Options opts_;
+  SenseKeyDictionary dict_;
+
+  std::mutex writeMutex_;                // serializes the writers
+  std::atomic<uint64_t> nextSeq_;
+
+  mutable std::mutex snapMutex_;
+  std::shared_ptr<Snapshot> snapshot_;   // protected by snapMutex_
+
+  std::mutex dictMutex_;
+  size_t persistedSenses_;               // protected by dictMutex_
+
+  std::mutex compactMutex_;
+  std::condition_variable compactCond_;
+  bool stop_;                            // protected by compactMutex_
+  std::thread compactor_;
+};
+
+} // namespace idilia
+
+#endif // IDILIA_RESULT_STORE_H
@@ -0,0 +1,117 @@
+/*
+ * Local evaluation of match.json sense filters.
+ *
+ * The filters are indexed by the lemma of their sense so that matching a document
+ * visits only the filters on the words it contains: the cost per document does not
+ * grow with the number of filters.
+ *
+ * The results follow the semantics of match.json: a filter matches a document where
+ * the word of its sense appears, and the match has a foundSk when the sense found
+ * is the sense of the filter. Unlike the service, equivalent senses are not considered;
+ * subscribe to each of them. Also, only the words that the semdoc gives a sense (an fs
+ * element) with the lemma of the filter's sense are candidates: a word left without a
+ * sense, or whose sense has another lemma (e.g. part of a multi-word expression or
+ * lemmatized differently), does not match locally where match.json may report it
+ * without a foundSk.
+ */
+
+#ifndef IDILIA_SENSE_FILTER_H
+#define IDILIA_SENSE_FILTER_H
+
+#include "json.h"
+#include "senses.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace idilia {
+
+
+// A match of a filter in a document
+struct LocalMatch
+{
+  uint32_t offset;
+  uint32_t length;
+  uint32_t foundSenseId; // SenseKeyDictionary::npos when the word matches with another sense
+};
+
+
+class SenseFilterIndex
+{
+public:
+  explicit SenseFilterIndex(SenseKeyDictionary & dict) : dict_(dict) {}
+
+  // Subscribe to the sense of a match.json filter such as {"fsk":"tide/N1"}.
+  // Returns false if the filter has no fsk.
+  bool addFilter(uint32_t subscriber, std::string_view filterJson)
+  {
+    std::string fsk;
+    if (!jsonStringMember(filterJson, "fsk", fsk))
+      return false;
+    addSense(subscriber, fsk);
+    return true;
+  }
+
+  void addSense(uint32_t subscriber, std::string_view fsk)
+  {
+    uint32_t senseId = dict_.senseId(fsk);
+    uint32_t lemmaId = dict_.lemmaOfSense(senseId);
+    if (lemmaId >= byLemma_.size())
+      byLemma_.resize(lemmaId + 1);
+    byLemma_[lemmaId].push_back(Subscription{subscriber, senseId});
+  }
+
+  // Call f(subscriber, const std::vector<LocalMatch> &) for each subscriber with matches in the document.
+  // Subscribers are reported in increasing order and their matches in document order.
+  // Not thread safe: the scratch space is reused between documents. Use an index per thread.
+  template <class F>
+  void match(const CompactSenses & senses, F f)
+  {
+    hits_.clear();
+    for (size_t i = 0; i < senses.size(); ++i)
+    {
+      uint32_t lemmaId = dict_.lemmaOfSense(senses[i].senseId);
+      if (lemmaId >= byLemma_.size())
+        continue;
+      const std::vector<Subscription> & subs = byLemma_[lemmaId];
+      for (size_t j = 0; j < subs.size(); ++j)
+      {
+        LocalMatch m = {senses[i].offset, senses[i].length,
+            subs[j].senseId == senses[i].senseId ? senses[i].senseId : SenseKeyDictionary::npos};
+        hits_.push_back(std::make_pair(subs[j].subscriber, m));
+      }
+    }
+
+    std::stable_sort(hits_.begin(), hits_.end(),
+        [](const Hit & a, const Hit & b) { return a.first < b.first; });
+    for (size_t st = 0, en; st < hits_.size(); st = en)
+    {
+      matches_.clear();
+      for (en = st; en < hits_.size() && hits_[en].first == hits_[st].first; ++en)
+        matches_.push_back(hits_[en].second);
+      f(hits_[st].first, matches_);
+    }
+  }
+
+private:
+  struct Subscription
+  {
+    uint32_t subscriber;
+    uint32_t senseId;
+  };
+  typedef std::pair<uint32_t, LocalMatch> Hit;
+
+  SenseKeyDictionary & dict_;
+  std::vector<std::vector<Subscription> > byLemma_; // indexed by lemma id
+
+  // Scratch space reused between documents
+  std::vector<Hit> hits_;
+  std::vector<LocalMatch> matches_;
+};
+
+} // namespace idilia
+
+#endif // IDILIA_SENSE_FILTER_H
@@ -0,0 +1,173 @@
+/*
+ * Compact representation of the senses found in a document.
+ *
+ * A semdoc is a large XML document. Once parsed, all that is needed to match sense
+ * filters or to index the document are the senses found and where. Sense keys are
+ * interned in a dictionary so that a sense occurrence is three integers.
+ */
+
+#ifndef IDILIA_SENSES_H
+#define IDILIA_SENSES_H
+
+#include <libxml/tree.h>
+#include <libxml/xpath.h>
+
+#include <cctype>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace idilia {
+
+
+// The lemma of a sense key is what precedes its part of speech (e.g. tide for tide/N1)
+inline std::string_view lemmaOf(std::string_view sk)
+{
+  size_t pos = sk.rfind('/');
+  return pos == std::string_view::npos ? sk : sk.substr(0, pos);
+}
+
+
+// Assigns dense ids to sense keys and to their lemmas. Thread safe.
+class SenseKeyDictionary
+{
+public:
+  static const uint32_t npos = ~0u;
+
+  // Returns the id of the sense key, assigning one if new
+  uint32_t senseId(std::string_view sk)
+  {
+    {
+      std::shared_lock<std::shared_mutex> lock(mutex_);
+      auto it = senseIds_.find(sk);
+      if (it != senseIds_.end())
+        return it->second;
+    }
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    auto it = senseIds_.find(sk);
+    if (it != senseIds_.end())
+      return it->second;
+    uint32_t lemma = internLemma(lemmaOf(sk));
+    senseKeys_.push_back(std::string(sk));
+    senseLemmas_.push_back(lemma);
+    return senseIds_[senseKeys_.back()] = senseKeys_.size() - 1;
+  }
+
+  // Returns the id of the sense key or npos if never seen
+  uint32_t findSense(std::string_view sk) const
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto it = senseIds_.find(sk);
+    return it == senseIds_.end() ? npos : it->second;
+  }
+
+  // Returns the id of the lemma (case insensitive) or npos if never seen
+  uint32_t findLemma(std::string_view lemma) const
+  {
+    std::string key = lower(lemma);
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto it = lemmaIds_.find(key);
+    return it == lemmaIds_.end() ? npos : it->second;
+  }
+
+  uint32_t lemmaOfSense(uint32_t id) const
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return senseLemmas_[id];
+  }
+
+  std::string senseKey(uint32_t id) const
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return senseKeys_[id];
+  }
+
+  size_t numSenses() const
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return senseKeys_.size();
+  }
+
+private:
+  static std::string lower(std::string_view s)
+  {
+    std::string res(s);
+    for (size_t i = 0; i < res.length(); ++i)
+      res[i] = tolower((unsigned char)res[i]);
+    return res;
+  }
+
+  // Called with the exclusive lock held
+  uint32_t internLemma(std::string_view lemma)
+  {
+    std::string key = lower(lemma);
+    auto it = lemmaIds_.find(key);
+    if (it != lemmaIds_.end())
+      return it->second;
+    lemmas_.push_back(key);
+    return lemmaIds_[lemmas_.back()] = lemmas_.size() - 1;
+  }
+
+  mutable std::shared_mutex mutex_;
+  std::deque<std::string> senseKeys_;   // the keys of the maps refer to these strings
+  std::vector<uint32_t> senseLemmas_;
+  std::unordered_map<std::string_view, uint32_t> senseIds_;
+  std::deque<std::string> lemmas_;
+  std::unordered_map<std::string_view, uint32_t> lemmaIds_;
+};
+
+
+// A sense found in a document
+struct SenseOccurrence
+{
+  uint32_t senseId;
+  uint32_t offset;   // byte offset of the words in the text
+  uint32_t length;   // 0 when the words could not be located in the text
+};
+
+typedef std::vector<SenseOccurrence> CompactSenses;
+
+
+// Extract the senses (fs elements) of a semdoc in document order.
+// The occurrences are located by searching the text of the fs elements in the document's text.
+inline void extractSenses(xmlDocPtr doc, std::string_view text, SenseKeyDictionary & dict, CompactSenses & out)
+{
+  out.clear();
+  xmlXPathContextPtr context = xmlXPathNewContext(doc);
+  xmlXPathObjectPtr result = xmlXPathEvalExpression((const xmlChar *) "//fs", context);
+  size_t cursor = 0;
+  for (int i = 0; result && result->nodesetval && i < result->nodesetval->nodeNr; i++)
+  {
+    xmlNodePtr fs = result->nodesetval->nodeTab[i];
+    xmlChar * sk = xmlGetProp(fs, (const xmlChar *) "sk");
+    if (!sk)
+      continue;
+    SenseOccurrence occ = {dict.senseId((const char *)sk), (uint32_t)cursor, 0};
+    xmlFree(sk);
+
+    xmlChar * content = xmlNodeGetContent(fs);
+    std::string_view words = content ? (const char *)content : "";
+    size_t st = words.find_first_not_of(" \t\r\n");
+    words = st == std::string_view::npos ? std::string_view() : words.substr(st, words.find_last_not_of(" \t\r\n") + 1 - st);
+    size_t pos = words.empty() ? std::string_view::npos : text.find(words, cursor);
+    if (pos != std::string_view::npos)
+    {
+      occ.offset = pos;
+      occ.length = words.length();
+      cursor = pos + words.length();
+    }
+    xmlFree(content);
+    out.push_back(occ);
+  }
+  xmlXPathFreeObject(result);
+  xmlXPathFreeContext(context);
+}
+
+} // namespace idilia
+
+#endif // IDILIA_SENSES_H
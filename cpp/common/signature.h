@@ -0,0 +1,113 @@
+/*
+ * Computation of Idilia's authentication headers.
+ *
+ * The signature is the HMAC-SHA256, keyed with the private key, of
+ *   <date>-<hostname>-<resource>-<base64 of the MD5 of the text>
+ * and is sent in the header "Authorization: IDILIA <access key>:<signature>"
+ * along with the Date and Host headers used to compute it.
+ *
+ * Environment variables IDILIA_ACCESS_KEY and IDILIA_PRIVATE_KEY must be set
+ * to the keys obtained from https://www.idilia.com/developer/my-projects
+ */
+
+#ifndef IDILIA_SIGNATURE_H
+#define IDILIA_SIGNATURE_H
+
+#include "arena.h"
+
+#include <curl/curl.h>
+
+#include <mhash.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <string_view>
+
+namespace idilia {
+
+
+// Encode a binary buffer to base64 in the arena. The result is nul-terminated.
+inline std::string_view encodeBase64(Arena & arena, const unsigned char * p, size_t len)
+{
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  size_t encLen = (len + 2) / 3 * 4;
+  char * out = (char *)arena.allocate(encLen + 1, 1);
+  char * o = out;
+  size_t i = 0;
+  for (; i + 3 <= len; i += 3)
+  {
+    unsigned v = (p[i] << 16) | (p[i + 1] << 8) | p[i + 2];
+    *o++ = alphabet[v >> 18];
+    *o++ = alphabet[(v >> 12) & 0x3F];
+    *o++ = alphabet[(v >> 6) & 0x3F];
+    *o++ = alphabet[v & 0x3F];
+  }
+  if (i < len)
+  {
+    unsigned v = p[i] << 16;
+    if (i + 1 < len)
+      v |= p[i + 1] << 8;
+    *o++ = alphabet[v >> 18];
+    *o++ = alphabet[(v >> 12) & 0x3F];
+    *o++ = i + 1 < len ? alphabet[(v >> 6) & 0x3F] : '=';
+    *o++ = '=';
+  }
+  *o = 0;
+  return std::string_view(out, encLen);
+}
+
+
+// Add Idilia's authentication headers to a CURL header list built in the arena.
+// The text is the content sent to the server: the document or the query.
+inline curl_slist * addSignature(Arena & arena, const char * hostname, std::string_view resource, const char * text, size_t textLen, curl_slist * headers)
+{
+  static const char * accessKey = getenv ("IDILIA_ACCESS_KEY");
+  static const char * privateKey = getenv ("IDILIA_PRIVATE_KEY");
+  if (!accessKey || !privateKey)
+    throw std::runtime_error("Environment variables IDILIA_ACCESS_KEY and IDILIA_PRIVATE_KEY must be set.");
+
+  // Get the date in HTTP format. The locale must be English to get the English day names.
+  char date[100];
+  {
+    time_t t = time(NULL);
+    struct tm tm;
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S %Z", gmtime_r(&t, &tm));
+  }
+  headers = arenaSlistAppend(arena, headers, {"Date: ", date});
+  headers = arenaSlistAppend(arena, headers, {"Host: ", hostname});
+
+  // Compute base64 of the MD5 of the text to send
+  std::string_view md5;
+  {
+    unsigned char bytes[64];
+    MHASH td = mhash_init(MHASH_MD5);
+    mhash(td, text, textLen);
+    mhash_deinit(td, bytes);
+    md5 = encodeBase64(arena, bytes, mhash_get_block_size(MHASH_MD5));
+  }
+
+  // Compute the authorization header
+  std::string_view signature;
+  {
+    MHASH td = mhash_hmac_init(MHASH_SHA256, const_cast<char *>(privateKey), strlen(privateKey), mhash_get_hash_pblock(MHASH_SHA256));
+    mhash(td, date, strlen(date));
+    mhash(td, "-", 1);
+    mhash(td, hostname, strlen(hostname));
+    mhash(td, "-", 1);
+    mhash(td, resource.data(), resource.length());
+    mhash(td, "-", 1);
+    mhash(td, md5.data(), md5.length());
+
+    unsigned char bytes[64];
+    mhash_hmac_deinit(td, bytes);
+    signature = encodeBase64(arena, bytes, mhash_get_block_size(MHASH_SHA256));
+  }
+
+  return arenaSlistAppend(arena, headers, {"Authorization: IDILIA ", accessKey, ":", signature});
+}
+
+} // namespace idilia
+
+#endif // IDILIA_SIGNATURE_H
@@ -0,0 +1,225 @@
+/*
+ * Trace files of the requests sent to the services and their responses.
+ *
+ * A trace records for each request its url, headers and body, when it was sent
+ * relative to the start of the trace, how long it took, and the response
+ * received including multipart bodies. Replaying a trace reproduces the shape
+ * of real traffic offline (see trace_replay.cc). The request signatures are
+ * recorded with the headers but the access key in the Authorization header is
+ * replaced by <redacted>; the private key is never sent.
+ *
+ * Only the requests posted with CURLOPT_POSTFIELDS through AsyncTransport can be
+ * recorded: a multipart request body built with curl's form API is not available
+ * to the writer, so the traffic of disambiguate_mpxml is not traced.
+ *
+ * The file is a gzip stream of length-prefixed records following a magic string.
+ * Integers are little-endian.
+ */
+
+#ifndef IDILIA_TRACE_H
+#define IDILIA_TRACE_H
+
+#include "response_buffer.h"
+
+#include <curl/curl.h>
+#include <zlib.h>
+
+#include <strings.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace idilia {
+
+
+struct TraceRecord
+{
+  uint64_t startUs;          // when the request was sent, from the start of the trace
+  uint32_t latencyUs;        // until the response was complete
+  uint32_t serviceUs;        // from the request sent to the first byte of the response
+  uint32_t httpCode;         // 0 when the request failed
+  std::string url;
+  std::string headers;       // request headers, one per line
+  std::string body;          // request body
+  std::string contentType;   // of the response
+  std::string response;
+};
+
+
+namespace trace_detail {
+
+constexpr char magic[] = "IDLTRC1\n";
+
+inline void put32(std::string & o, uint32_t v)
+{
+  char b[4] = {char(v), char(v >> 8), char(v >> 16), char(v >> 24)};
+  o.append(b, 4);
+}
+
+inline void put64(std::string & o, uint64_t v)
+{
+  put32(o, uint32_t(v));
+  put32(o, uint32_t(v >> 32));
+}
+
+inline void putStr(std::string & o, std::string_view s)
+{
+  put32(o, s.length());
+  o.append(s.data(), s.length());
+}
+
+// Append a request header, without the access key of "Authorization: IDILIA <access key>:<signature>"
+inline void putHeader(std::string & o, std::string_view h)
+{
+  static const std::string_view auth = "Authorization:";
+  if (h.length() < auth.length() || strncasecmp(h.data(), auth.data(), auth.length()) != 0)
+  {
+    o.append(h.data(), h.length()).push_back('\n');
+    return;
+  }
+  size_t sep = h.rfind(':');
+  size_t st = h.rfind(' ', sep);
+  if (sep == auth.length() - 1 || st == std::string_view::npos || st < auth.length())
+    o.append(auth).append(" <redacted>");
+  else
+    o.append(h.substr(0, st + 1)).append("<redacted>").append(h.substr(sep));
+  o.push_back('\n');
+}
+
+} // namespace trace_detail
+
+
+// Appends records to a trace file. Thread safe.
+class TraceWriter
+{
+public:
+  explicit TraceWriter(const std::string & fn) : gz_(gzopen(fn.c_str(), "wb6")), start_(std::chrono::steady_clock::now())
+  {
+    if (!gz_)
+      throw std::runtime_error("Could not create " + fn);
+    gzwrite(gz_, trace_detail::magic, sizeof(trace_detail::magic) - 1);
+  }
+  ~TraceWriter()
+  {
+    gzclose(gz_);
+  }
+
+  TraceWriter(const TraceWriter &) = delete;
+  TraceWriter & operator=(const TraceWriter &) = delete;
+
+  // Record a completed request submitted at time sent.
+  // headers is the list given to CURLOPT_HTTPHEADER and body the one given to CURLOPT_POSTFIELDS.
+  void record(CURL * curl, std::chrono::steady_clock::time_point sent, const curl_slist * headers,
+      std::string_view body, long httpCode, const RopeView & response)
+  {
+    using namespace std::chrono;
+    steady_clock::time_point now = steady_clock::now();
+    char * url = 0;
+    char * contentType = 0;
+    curl_off_t preTransfer = 0, startTransfer = 0;
+    curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+    curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &contentType);
+    curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &preTransfer);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &startTransfer);
+
+    std::string rec;
+    rec.reserve(128 + body.length() + response.length());
+    trace_detail::put64(rec, sent > start_ ? duration_cast<microseconds>(sent - start_).count() : 0);
+    trace_detail::put32(rec, duration_cast<microseconds>(now - sent).count());
+    trace_detail::put32(rec, startTransfer > preTransfer ? startTransfer - preTransfer : 0);
+    trace_detail::put32(rec, httpCode);
+    trace_detail::putStr(rec, url ? url : "");
+    size_t lenAt = rec.length();
+    trace_detail::put32(rec, 0); // length of the headers, set once written
+    for (const curl_slist * h = headers; h; h = h->next)
+      trace_detail::putHeader(rec, h->data);
+    std::string len;
+    trace_detail::put32(len, rec.length() - lenAt - 4);
+    rec.replace(lenAt, 4, len);
+    trace_detail::putStr(rec, body);
+    trace_detail::putStr(rec, contentType ? contentType : "");
+    trace_detail::put32(rec, response.length());
+    response.forEachSegment([&rec](std::string_view seg) { rec.append(seg.data(), seg.length()); });
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    gzwrite(gz_, rec.data(), rec.length());
+  }
+
+private:
+  std::mutex mutex_;
+  gzFile gz_;            // protected by mutex_
+  std::chrono::steady_clock::time_point start_;
+};
+
+
+// Reads the records of a trace file in order
+class TraceReader
+{
+public:
+  explicit TraceReader(const std::string & fn) : gz_(gzopen(fn.c_str(), "rb"))
+  {
+    if (!gz_)
+      throw std::runtime_error("Could not open " + fn);
+    char m[sizeof(trace_detail::magic) - 1];
+    if (gzread(gz_, m, sizeof(m)) != (int)sizeof(m) || memcmp(m, trace_detail::magic, sizeof(m)) != 0)
+    {
+      gzclose(gz_);
+      throw std::runtime_error(fn + " is not a trace file");
+    }
+  }
+  ~TraceReader()
+  {
+    gzclose(gz_);
+  }
+
+  TraceReader(const TraceReader &) = delete;
+  TraceReader & operator=(const TraceReader &) = delete;
+
+  // Returns false at the end of the trace. Throws on a truncated record.
+  bool next(TraceRecord & rec)
+  {
+    unsigned char b[20];
+    int n = gzread(gz_, b, sizeof(b));
+    if (n == 0)
+      return false;
+    if (n != (int)sizeof(b))
+      throw std::runtime_error("Truncated trace record");
+    rec.startUs = get32(b) | uint64_t(get32(b + 4)) << 32;
+    rec.latencyUs = get32(b + 8);
+    rec.serviceUs = get32(b + 12);
+    rec.httpCode = get32(b + 16);
+    readStr(rec.url);
+    readStr(rec.headers);
+    readStr(rec.body);
+    readStr(rec.contentType);
+    readStr(rec.response);
+    return true;
+  }
+
+private:
+  static uint32_t get32(const unsigned char * p)
+  {
+    return p[0] | p[1] << 8 | p[2] << 16 | uint32_t(p[3]) << 24;
+  }
+
+  void readStr(std::string & s)
+  {
+    unsigned char b[4];
+    if (gzread(gz_, b, 4) != 4)
+      throw std::runtime_error("Truncated trace record");
+    s.resize(get32(b));
+    if (!s.empty() && gzread(gz_, &s[0], s.length()) != (int)s.length())
+      throw std::runtime_error("Truncated trace record");
+  }
+
+  gzFile gz_;
+};
+
+} // namespace idilia
+
+#endif // IDILIA_TRACE_H
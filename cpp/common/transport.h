@@ -0,0 +1,283 @@
+/*
+ * Asynchronous transport running many requests concurrently on one thread
+ * with the curl multi interface.
+ *
+ * Requires libcurl 7.68 or later for curl_multi_poll and curl_multi_wakeup.
+ */
+
+#ifndef IDILIA_TRANSPORT_H
+#define IDILIA_TRANSPORT_H
+
+#include "arena.h"
+#include "circuit_breaker.h"
+#include "response_buffer.h"
+#include "signature.h"
+
+#include <curl/curl.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace idilia {
+
+
+// A request submitted to the AsyncTransport. Owns everything allocated for it.
+struct AsyncRequest
+{
+  // Called on the transport's thread when the request completes.
+  // httpCode is 0 when the request could not be performed (see cc). A request failed fast
+  // by its breaker completes with CURLE_ABORTED_BY_CALLBACK and admission set to rejected.
+  typedef std::function<void(AsyncRequest & req, CURLcode cc, long httpCode)> DoneFn;
+
+  // Called instead of onDone with the ownership of the request, e.g. to hand the response
+  // to other threads for parsing without copying it.
+  typedef std::function<void(std::unique_ptr<AsyncRequest> req, CURLcode cc, long httpCode)> HandOffFn;
+
+  AsyncRequest() : curl(curl_easy_init()), headers(0), response(arena), breaker(0), admission(CircuitBreaker::admitted)
+  {
+    if (!curl)
+      throw std::runtime_error("Could not obtain CURL handle");
+  }
+  ~AsyncRequest()
+  {
+    curl_easy_cleanup(curl);
+  }
+
+  AsyncRequest(const AsyncRequest &) = delete;
+  AsyncRequest & operator=(const AsyncRequest &) = delete;
+
+  Arena arena;             // declared first: released last
+  CURL * curl;
+  curl_slist * headers;    // built in the arena
+  std::string_view body;   // posted body, kept for recording
+  ResponseBuffer response;
+  DoneFn onDone;
+  HandOffFn handOff;
+  std::chrono::steady_clock::time_point submitted; // set by AsyncTransport::submit
+  std::chrono::steady_clock::time_point sent;      // on a connection, with curl older than 8.6
+  CircuitBreaker * breaker;                         // of the endpoint, if any
+  CircuitBreaker::Admission admission;              // set by AsyncTransport::submit
+};
+
+
+// Prepare the request to POST body to http://<hostname><resource>.
+// The signature is computed on signedText, the text or document of the request.
+// The body must remain valid until the request completes; normally it is in the request's arena.
+inline void preparePost(AsyncRequest & req, const char * hostname, std::string_view resource,
+    std::string_view contentType, std::string_view body, std::string_view signedText)
+{
+  std::string_view url = req.arena.concat({"http://", hostname, resource});
+  curl_easy_setopt(req.curl, CURLOPT_URL, url.data());
+  curl_easy_setopt(req.curl, CURLOPT_POSTFIELDSIZE, (long)body.length());
+  curl_easy_setopt(req.curl, CURLOPT_POSTFIELDS, body.data());
+  curl_easy_setopt(req.curl, CURLOPT_ACCEPT_ENCODING, "");
+  req.body = body;
+  req.response.setup(req.curl);
+
+  req.headers = arenaSlistAppend(req.arena, req.headers, {"Expect:"}); // Don't wait for this
+  req.headers = arenaSlistAppend(req.arena, req.headers, {"Content-Type: ", contentType});
+  req.headers = addSignature(req.arena, hostname, resource, signedText.data(), signedText.length(), req.headers);
+  curl_easy_setopt(req.curl, CURLOPT_HTTPHEADER, req.headers);
+}
+
+
+// Runs the submitted requests on its own thread.
+// Connections are reused between requests and at most maxConcurrent are opened.
+class AsyncTransport
+{
+public:
+  explicit AsyncTransport(unsigned maxConcurrent = 16) : multi_(curl_multi_init()), stop_(false)
+  {
+    if (!multi_)
+      throw std::runtime_error("Could not obtain CURL multi handle");
+    curl_multi_setopt(multi_, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)maxConcurrent);
+    thread_ = std::thread(&AsyncTransport::loop, this);
+  }
+
+  // Requests still in progress are completed with CURLE_ABORTED_BY_CALLBACK
+  ~AsyncTransport()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    curl_multi_wakeup(multi_);
+    thread_.join();
+
+    for (size_t i = 0; i < submitted_.size(); ++i)
+      active_.push_back(submitted_[i]);
+    for (size_t i = 0; i < active_.size(); ++i)
+    {
+      curl_multi_remove_handle(multi_, active_[i]->curl);
+      complete(std::unique_ptr<AsyncRequest>(active_[i]), CURLE_ABORTED_BY_CALLBACK, 0);
+    }
+    curl_multi_cleanup(multi_);
+  }
+
+  AsyncTransport(const AsyncTransport &) = delete;
+  AsyncTransport & operator=(const AsyncTransport &) = delete;
+
+  // Set a function called for every completed request before its onDone, for instance
+  // to record a trace. Runs on the transport's thread. Call before submitting requests.
+  void observe(AsyncRequest::DoneFn observer) { observer_ = std::move(observer); }
+
+  // Start a request. Thread safe; can be called from a completion callback.
+  // A request whose breaker is open is completed at once without being sent.
+  void submit(std::unique_ptr<AsyncRequest> req)
+  {
+    req->submitted = std::chrono::steady_clock::now();
+    if (req->breaker)
+      req->admission = req->breaker->admit();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      submitted_.push_back(req.release());
+    }
+    curl_multi_wakeup(multi_);
+  }
+
+private:
+  void loop()
+  {
+    std::vector<AsyncRequest *> added;
+    for (;;)
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stop_)
+          return;
+        added.swap(submitted_);
+      }
+      for (size_t i = 0; i < added.size(); ++i)
+      {
+        if (added[i]->admission == CircuitBreaker::rejected)
+        {
+          complete(std::unique_ptr<AsyncRequest>(added[i]), CURLE_ABORTED_BY_CALLBACK, 0);
+          continue;
+        }
+        curl_easy_setopt(added[i]->curl, CURLOPT_PRIVATE, added[i]);
+#if LIBCURL_VERSION_NUM >= 0x075000 && LIBCURL_VERSION_NUM < 0x080600
+        curl_easy_setopt(added[i]->curl, CURLOPT_PREREQFUNCTION, &AsyncTransport::onSent);
+        curl_easy_setopt(added[i]->curl, CURLOPT_PREREQDATA, added[i]);
+#endif
+        curl_multi_add_handle(multi_, added[i]->curl);
+        active_.push_back(added[i]);
+      }
+      added.clear();
+
+      int running;
+      curl_multi_perform(multi_, &running);
+
+      int left;
+      for (CURLMsg * msg; (msg = curl_multi_info_read(multi_, &left)); )
+      {
+        if (msg->msg != CURLMSG_DONE)
+          continue;
+        CURL * easy = msg->easy_handle;
+        CURLcode cc = msg->data.result;
+        AsyncRequest * p;
+        curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char **)&p);
+        curl_multi_remove_handle(multi_, easy);
+        active_.erase(std::find(active_.begin(), active_.end(), p));
+
+        long httpCode = 0;
+        if (cc == CURLE_OK)
+          curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &httpCode);
+        complete(std::unique_ptr<AsyncRequest>(p), cc, httpCode);
+      }
+
+      curl_multi_poll(multi_, NULL, 0, 1000, NULL);
+    }
+  }
+
+  // The request is deleted after its onDone, or given to its handOff
+  void complete(std::unique_ptr<AsyncRequest> p, CURLcode cc, long httpCode)
+  {
+    AsyncRequest & req = *p;
+    if (req.breaker && req.admission != CircuitBreaker::rejected)
+    {
+      // Only the outcomes that tell about the health of the endpoint
+      if (cc == CURLE_ABORTED_BY_CALLBACK)
+        req.breaker->cancel(req.admission);
+      else
+        req.breaker->record(req.admission, cc == CURLE_OK && httpCode < 500 && httpCode != 429, latency(req));
+    }
+    if (observer_)
+      notify(observer_, req, cc, httpCode);
+    if (req.handOff)
+    {
+      // Moved out: the request can be deleted on another thread before handOff returns
+      AsyncRequest::HandOffFn handOff = std::move(req.handOff);
+      try
+      {
+        handOff(std::move(p), cc, httpCode);
+      }
+      catch (const std::exception & e)
+      {
+        std::cerr << "Request completion failed: " << e.what() << std::endl;
+      }
+    }
+    else if (req.onDone)
+      notify(req.onDone, req, cc, httpCode);
+  }
+
+  // The time the endpoint took for a request, without the time it waited for a connection
+  // behind CURLMOPT_MAX_TOTAL_CONNECTIONS
+  static std::chrono::microseconds latency(AsyncRequest & req)
+  {
+#if LIBCURL_VERSION_NUM >= 0x080600
+    curl_off_t total = 0, queued = 0;
+    curl_easy_getinfo(req.curl, CURLINFO_TOTAL_TIME_T, &total);
+    curl_easy_getinfo(req.curl, CURLINFO_QUEUE_TIME_T, &queued);
+    return std::chrono::microseconds(total - queued);
+#else
+    // The total time counts the wait for a connection. The connection setup, timed from
+    // the end of the wait, and the time since the request was sent do not.
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (req.sent == std::chrono::steady_clock::time_point())
+      return std::chrono::duration_cast<std::chrono::microseconds>(now - req.submitted);
+    curl_off_t setup = 0;
+    curl_easy_getinfo(req.curl, CURLINFO_PRETRANSFER_TIME_T, &setup);
+    return std::chrono::microseconds(setup) + std::chrono::duration_cast<std::chrono::microseconds>(now - req.sent);
+#endif
+  }
+
+#if LIBCURL_VERSION_NUM >= 0x075000 && LIBCURL_VERSION_NUM < 0x080600
+  static int onSent(void * p, char *, char *, int, int)
+  {
+    ((AsyncRequest *)p)->sent = std::chrono::steady_clock::now();
+    return CURL_PREREQFUNC_OK;
+  }
+#endif
+
+  static void notify(const AsyncRequest::DoneFn & f, AsyncRequest & req, CURLcode cc, long httpCode)
+  {
+    try
+    {
+      f(req, cc, httpCode);
+    }
+    catch (const std::exception & e)
+    {
+      std::cerr << "Request completion failed: " << e.what() << std::endl;
+    }
+  }
+
+  CURLM * multi_;
+  std::mutex mutex_;
+  bool stop_;                              // protected by mutex_
+  std::vector<AsyncRequest *> submitted_;  // protected by mutex_
+  std::vector<AsyncRequest *> active_;     // used by the transport's thread only
+  AsyncRequest::DoneFn observer_;
+  std::thread thread_;
+};
+
+} // namespace idilia
+
+#endif // IDILIA_TRANSPORT_H
@@ -0,0 +1,297 @@
+/*
+ * Work-stealing thread pool for CPU bound post-processing of the responses
+ * (parsing semdocs, extracting senses), off the I/O threads.
+ *
+ * Each worker has its own queue: it runs its tasks newest first and, when idle,
+ * steals the oldest tasks of the others, starting with the workers on the same
+ * NUMA node. Workers are pinned one per CPU, spread node by node, and create
+ * their state after pinning so that it lives in memory local to their node.
+ * Each worker keeps a libxml2 parser context reused for all the documents it
+ * parses and an arena released after each task.
+ *
+ * Submitting a task only takes a short lock: I/O threads such as the
+ * AsyncTransport's can hand off responses without waiting for the parsing.
+ */
+
+#ifndef IDILIA_WORK_POOL_H
+#define IDILIA_WORK_POOL_H
+
+#include "arena.h"
+
+#include <libxml/parser.h>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace idilia {
+
+
+// The CPUs that the process may use, grouped by NUMA node.
+// A single group when the topology is not available.
+inline std::vector<std::vector<int> > numaNodeCpus()
+{
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    for (int c = 0; c < (int)std::thread::hardware_concurrency(); ++c)
+      CPU_SET(c, &allowed);
+
+  std::vector<std::vector<int> > nodes;
+  for (int n = 0; ; ++n)
+  {
+    std::ifstream is("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist");
+    if (!is)
+      break;
+    // Ranges such as 0-3,8-11
+    std::vector<int> cpus;
+    std::string range;
+    while (std::getline(is, range, ','))
+    {
+      int lo, hi;
+      int k = sscanf(range.c_str(), "%d-%d", &lo, &hi);
+      if (k < 1)
+        continue;
+      for (int c = lo; c <= (k == 2 ? hi : lo); ++c)
+        if (c < CPU_SETSIZE && CPU_ISSET(c, &allowed))
+          cpus.push_back(c);
+    }
+    if (!cpus.empty())
+      nodes.push_back(cpus);
+  }
+
+  if (nodes.empty())
+  {
+    nodes.resize(1);
+    for (int c = 0; c < CPU_SETSIZE; ++c)
+      if (CPU_ISSET(c, &allowed))
+        nodes[0].push_back(c);
+  }
+  return nodes;
+}
+
+
+// State of a worker given to the tasks it runs
+struct WorkerContext
+{
+  unsigned id;
+  unsigned node;              // index of the NUMA node of the worker
+  Arena arena;                // released after each task
+  xmlParserCtxtPtr xmlParser; // for readXmlDoc(xmlParser, ...)
+};
+
+
+class WorkStealingPool
+{
+public:
+  typedef std::function<void(WorkerContext & ctx)> Task;
+
+  // One worker per CPU available when numWorkers is 0. Use fewer to leave CPUs to the I/O threads.
+  // libxml2 must have been initialized.
+  explicit WorkStealingPool(unsigned numWorkers = 0, bool pin = true) :
+    stop_(false), numQueued_(0), numUnfinished_(0), nextQueue_(0)
+  {
+    std::vector<std::vector<int> > nodes = numaNodeCpus();
+    std::vector<std::pair<int, unsigned> > cpus; // cpu and node, node by node
+    for (unsigned n = 0; n < nodes.size(); ++n)
+      for (size_t i = 0; i < nodes[n].size(); ++i)
+        cpus.push_back(std::make_pair(nodes[n][i], n));
+    if (!numWorkers)
+      numWorkers = cpus.size();
+
+    for (unsigned i = 0; i < numWorkers; ++i)
+    {
+      workers_.emplace_back(new Worker);
+      workers_[i]->cpu = pin ? cpus[i % cpus.size()].first : -1;
+      workers_[i]->node = cpus[i % cpus.size()].second;
+    }
+
+    // Steal from the workers of the same node first, each starting after itself to spread the thefts
+    for (unsigned i = 0; i < numWorkers; ++i)
+    {
+      for (unsigned k = 1; k < numWorkers; ++k)
+        if (workers_[(i + k) % numWorkers]->node == workers_[i]->node)
+          workers_[i]->victims.push_back((i + k) % numWorkers);
+      for (unsigned k = 1; k < numWorkers; ++k)
+        if (workers_[(i + k) % numWorkers]->node != workers_[i]->node)
+          workers_[i]->victims.push_back((i + k) % numWorkers);
+    }
+
+    for (unsigned i = 0; i < numWorkers; ++i)
+      workers_[i]->thread = std::thread(&WorkStealingPool::run, this, i);
+  }
+
+  // Runs the tasks already submitted before returning
+  ~WorkStealingPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(sleepMutex_);
+      stop_ = true;
+    }
+    sleepCv_.notify_all();
+    for (size_t i = 0; i < workers_.size(); ++i)
+      workers_[i]->thread.join();
+  }
+
+  WorkStealingPool(const WorkStealingPool &) = delete;
+  WorkStealingPool & operator=(const WorkStealingPool &) = delete;
+
+  unsigned numWorkers() const { return workers_.size(); }
+
+  // Queue a task. Thread safe. A task submitted by a worker goes to its own queue.
+  void submit(Task task)
+  {
+    {
+      std::lock_guard<std::mutex> lock(doneMutex_);
+      ++numUnfinished_;
+    }
+    const CurrentWorker & self = currentWorker();
+    Worker & w = *workers_[self.pool == this ? self.index : nextQueue_++ % workers_.size()];
+    {
+      std::lock_guard<std::mutex> lock(w.mutex);
+      w.tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard<std::mutex> lock(sleepMutex_);
+      ++numQueued_;
+    }
+    sleepCv_.notify_one();
+  }
+
+  // Wait until all the tasks submitted have run
+  void wait()
+  {
+    std::unique_lock<std::mutex> lock(doneMutex_);
+    doneCv_.wait(lock, [this] { return numUnfinished_ == 0; });
+  }
+
+private:
+  struct Worker
+  {
+    std::mutex mutex;
+    std::deque<Task> tasks;        // protected by mutex
+    std::vector<unsigned> victims; // in the order to steal from
+    int cpu;                       // -1 when not pinned
+    unsigned node;
+    std::thread thread;
+  };
+
+  // The worker running on the calling thread, if any
+  struct CurrentWorker
+  {
+    const WorkStealingPool * pool;
+    unsigned index;
+  };
+  static CurrentWorker & currentWorker()
+  {
+    static thread_local CurrentWorker current = {0, 0};
+    return current;
+  }
+
+  bool popLocal(Worker & w, Task & task)
+  {
+    std::lock_guard<std::mutex> lock(w.mutex);
+    if (w.tasks.empty())
+      return false;
+    task = std::move(w.tasks.back());
+    w.tasks.pop_back();
+    return true;
+  }
+
+  bool steal(Worker & w, Task & task)
+  {
+    for (size_t i = 0; i < w.victims.size(); ++i)
+    {
+      Worker & v = *workers_[w.victims[i]];
+      std::lock_guard<std::mutex> lock(v.mutex);
+      if (v.tasks.empty())
+        continue;
+      task = std::move(v.tasks.front());
+      v.tasks.pop_front();
+      return true;
+    }
+    return false;
+  }
+
+  void run(unsigned index)
+  {
+    Worker & w = *workers_[index];
+    if (w.cpu >= 0)
+    {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(w.cpu, &set);
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    currentWorker() = CurrentWorker{this, index};
+
+    // Created after pinning so that the memory is first touched on the worker's node
+    WorkerContext ctx;
+    ctx.id = index;
+    ctx.node = w.node;
+    ctx.xmlParser = xmlCreatePushParserCtxt(NULL, NULL, NULL, 0, NULL);
+    if (!ctx.xmlParser)
+      std::cerr << "Could not create the XML parser of worker " << index << std::endl;
+
+    for (;;)
+    {
+      Task task;
+      if (popLocal(w, task) || steal(w, task))
+      {
+        --numQueued_;
+        try
+        {
+          task(ctx);
+        }
+        catch (const std::exception & e)
+        {
+          std::cerr << "Task failed: " << e.what() << std::endl;
+        }
+        task = Task();
+        ctx.arena.release();
+
+        std::lock_guard<std::mutex> lock(doneMutex_);
+        if (--numUnfinished_ == 0)
+          doneCv_.notify_all();
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(sleepMutex_);
+      sleepCv_.wait(lock, [this] { return stop_ || numQueued_ > 0; });
+      if (stop_ && numQueued_ <= 0)
+        break;
+    }
+
+    if (ctx.xmlParser)
+      xmlFreeParserCtxt(ctx.xmlParser);
+  }
+
+  std::vector<std::unique_ptr<Worker> > workers_;
+
+  std::mutex sleepMutex_;
+  std::condition_variable sleepCv_;
+  bool stop_;                   // protected by sleepMutex_
+  std::atomic<long> numQueued_; // incremented under sleepMutex_ so that no wake up is lost
+
+  std::mutex doneMutex_;
+  std::condition_variable doneCv_;
+  size_t numUnfinished_;        // protected by doneMutex_
+
+  std::atomic<unsigned> nextQueue_;
+};
+
+} // namespace idilia
+
+#endif // IDILIA_WORK_POOL_H
@@ -0,0 +1,55 @@
+/*
+ * Helpers for parsing the XML documents returned by the server with libxml2.
+ */
+
+#ifndef IDILIA_XML_H
+#define IDILIA_XML_H
+
+#include "response_buffer.h"
+
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+
+namespace idilia {
+
+
+// Parse a document stored in several segments with a push parser context
+// that is reset and reused from one document to the next. Do not parse in an
+// XmlArenaScope with such a context: its buffers and dictionary outlive the document.
+// The segments are fed as-is instead of being copied to a contiguous buffer.
+// Returns NULL if not well formed.
+inline xmlDocPtr readXmlDoc(xmlParserCtxtPtr ctxt, const RopeView & rope, int options = 0)
+{
+  if (xmlCtxtResetPush(ctxt, NULL, 0, NULL, NULL) != 0)
+    return NULL;
+  xmlCtxtUseOptions(ctxt, options);
+  rope.forEachSegment([ctxt](std::string_view seg) {
+    if (ctxt->wellFormed)
+      xmlParseChunk(ctxt, seg.data(), seg.length(), 0);
+  });
+  xmlParseChunk(ctxt, NULL, 0, 1);
+
+  xmlDocPtr doc = ctxt->myDoc;
+  ctxt->myDoc = NULL;
+  if (!ctxt->wellFormed && doc)
+  {
+    xmlFreeDoc(doc);
+    doc = NULL;
+  }
+  return doc;
+}
+
+// Parse a document stored in several segments with a context of its own
+inline xmlDocPtr readXmlDoc(const RopeView & rope, int options = 0)
+{
+  xmlParserCtxtPtr ctxt = xmlCreatePushParserCtxt(NULL, NULL, NULL, 0, NULL);
+  if (!ctxt)
+    return NULL;
+  xmlDocPtr doc = readXmlDoc(ctxt, rope, options);
+  xmlFreeParserCtxt(ctxt);
+  return doc;
+}
+
+} // namespace idilia
+
+#endif // IDILIA_XML_H
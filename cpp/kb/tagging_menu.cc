@@ -0,0 +1,338 @@
+/*
+ * Example program to obtain tagging menus with kb/tagging_menu.json using libcurl.
+ * Uses text/disambiguate.mpjson to obtain the sense analysis results
+ * for the text to sense tag and then the kb/tagging_menu.json
+ * API to obtain the tagging menu.
+ *
+ * This is an example of the "server" side code for an interactive UI. When a document
+ * is loaded, the menus of all its words are fetched concurrently in the background
+ * and cached by (lemma, context hash) so that opening a menu is a cache lookup.
+ * The menus obtained would be relayed to matching javascript client code and animated
+ * using the jquery_tagging_menu.js plugin.
+ *
+ * Environment variables IDILIA_ACCESS_KEY and IDILIA_PRIVATE_KEY must be set
+ * to the keys obtained from https://www.idilia.com/developer/my-projects
+ *
+ * Requires the RPMs: mhash-devel curl-devel libxml2-devel
+ *
+ * Compile with:
+ *   g++ -std=c++17 -pthread -o tagging_menu -I /usr/include/libxml2 -lxml2 -lmhash -lcurl tagging_menu.cc
+ *
+ */
+
+#include "../common/http.h"
+#include "../common/json.h"
+#include "../common/lru_cache.h"
+#include "../common/transport.h"
+
+#include <curl/curl.h>
+
+#include <string>
+#include <vector>
+#include <future>
+#include <mutex>
+#include <unordered_map>
+#include <stdexcept>
+#include <iostream>
+#include <cctype>
+
+using namespace std;
+
+
+// Menus are cached by the lemma of the word and a hash of the words around it
+struct MenuKey
+{
+  string lemma;
+  uint64_t contextHash;
+
+  bool operator==(const MenuKey & o) const { return contextHash == o.contextHash && lemma == o.lemma; }
+};
+
+struct MenuKeyHash
+{
+  size_t operator()(const MenuKey & k) const { return hash<string>()(k.lemma) ^ k.contextHash; }
+};
+
+
+// The HTML fragments returned by the tagging menu API
+struct TaggingMenu
+{
+  string text; // HTML for the word
+  string menu; // HTML for its menu
+};
+
+
+// A word of a document with the text to send to obtain its menu
+struct MenuToken
+{
+  string surface;
+  MenuKey key;
+  string queryHtml;
+};
+
+
+// Client fetching and caching the tagging menus.
+// Fetching is asynchronous: prefetch() returns immediately and the menus are
+// obtained concurrently on the thread of the transport.
+class TaggingMenuClient
+{
+public:
+  typedef idilia::LruCache<MenuKey, TaggingMenu, MenuKeyHash>::ValuePtr TaggingMenuPtr;
+
+  struct Options
+  {
+    Options() : menuTemplate("image_v3"), filters("noDynamic"), contextWords(2), cacheSize(100000), maxConcurrent(16) {}
+    string menuTemplate;
+    string filters;
+    unsigned contextWords;   // number of words on each side of a word used as its context
+    size_t cacheSize;        // number of menus cached
+    unsigned maxConcurrent;  // number of simultaneous requests
+  };
+
+  TaggingMenuClient(const Options & opts = Options()) : opts_(opts), cache_(opts.cacheSize), transport_(opts.maxConcurrent) {}
+
+  // Split a document in words and compute their keys
+  vector<MenuToken> tokenize(const string & doc) const
+  {
+    vector<string> words;
+    for (size_t st = doc.find_first_not_of(" \t\r\n"); st != string::npos; )
+    {
+      size_t en = doc.find_first_of(" \t\r\n", st);
+      words.push_back(doc.substr(st, en == string::npos ? string::npos : en - st));
+      st = en == string::npos ? en : doc.find_first_not_of(" \t\r\n", en);
+    }
+
+    vector<MenuToken> tokens(words.size());
+    for (size_t i = 0; i < words.size(); ++i)
+    {
+      size_t first = i >= opts_.contextWords ? i - opts_.contextWords : 0;
+      size_t last = min(words.size(), i + opts_.contextWords + 1);
+
+      MenuToken & tok = tokens[i];
+      tok.surface = words[i];
+      tok.key.lemma = normalize(words[i]);
+      tok.key.contextHash = 14695981039346656037ULL; // FNV-1a over the normalized context
+      for (size_t j = first; j < last; ++j)
+      {
+        string w = j == i ? string("\x01") : normalize(words[j]);
+        for (size_t k = 0; k <= w.length(); ++k)
+          tok.key.contextHash = (tok.key.contextHash ^ (unsigned char)w.c_str()[k]) * 1099511628211ULL;
+
+        // Wrap each word in a paragraph. Only the word of the menu is analyzed.
+        tok.queryHtml += j == i ? "<p>" : "<p><span data-idl-fsk=\"ina\">";
+        tok.queryHtml += escapeHtml(words[j]);
+        tok.queryHtml += j == i ? "</p>" : "</span></p>";
+      }
+    }
+    return tokens;
+  }
+
+  // Start fetching the menus of the words of the document that are not cached.
+  // Returns the words of the document.
+  vector<MenuToken> prefetch(const string & doc)
+  {
+    vector<MenuToken> tokens = tokenize(doc);
+    for (size_t i = 0; i < tokens.size(); ++i)
+      if (!cache_.get(tokens[i].key))
+        fetch(tokens[i]);
+    return tokens;
+  }
+
+  // Returns the menu if it is cached, without waiting
+  TaggingMenuPtr lookup(const MenuKey & key)
+  {
+    return cache_.get(key);
+  }
+
+  // Returns the menu of a word, waiting for it to be obtained if necessary.
+  // Returns an empty pointer if the menu could not be obtained.
+  // Must not be called from the thread of the transport.
+  TaggingMenuPtr get(const MenuToken & tok)
+  {
+    TaggingMenuPtr menu = cache_.get(tok.key);
+    return menu ? menu : fetch(tok).get();
+  }
+
+private:
+  static string normalize(const string & word)
+  {
+    size_t st = 0, en = word.length();
+    while (st < en && ispunct((unsigned char)word[st]))
+      ++st;
+    while (en > st && ispunct((unsigned char)word[en - 1]))
+      --en;
+    string res = word.substr(st, en - st);
+    for (size_t i = 0; i < res.length(); ++i)
+      res[i] = tolower((unsigned char)res[i]);
+    return res;
+  }
+
+  static string escapeHtml(const string & s)
+  {
+    string res;
+    for (size_t i = 0; i < s.length(); ++i)
+    {
+      switch (s[i])
+      {
+      case '&': res += "&amp;"; break;
+      case '<': res += "&lt;"; break;
+      case '>': res += "&gt;"; break;
+      case '"': res += "&quot;"; break;
+      default: res += s[i];
+      }
+    }
+    return res;
+  }
+
+  // Obtain the menu of a word unless it is already being obtained
+  shared_future<TaggingMenuPtr> fetch(const MenuToken & tok)
+  {
+    shared_ptr<promise<TaggingMenuPtr> > result;
+    shared_future<TaggingMenuPtr> future;
+    {
+      lock_guard<mutex> lock(mutex_);
+      unordered_map<MenuKey, shared_future<TaggingMenuPtr>, MenuKeyHash>::iterator it = inFlight_.find(tok.key);
+      if (it != inFlight_.end())
+        return it->second;
+      result = make_shared<promise<TaggingMenuPtr> >();
+      future = result->get_future().share();
+      inFlight_[tok.key] = future;
+    }
+
+    // The waiters of the key must get a result even if the request cannot be made
+    MenuKey key = tok.key;
+    try
+    {
+      // First obtain sense analysis results.
+      // Request a resultMime of type application/x-tf+xml+gz because
+      // that's the expected input to the tagging_menu API.
+      unique_ptr<idilia::AsyncRequest> req(new idilia::AsyncRequest);
+      idilia::Arena & arena = req->arena;
+      string_view text = arena.strdup(tok.queryHtml.data(), tok.queryHtml.length());
+      idilia::RequestParms parms(arena);
+      parms["text"] = text;
+      parms["textMime"] = "text/query-html; charset=UTF-8";
+      parms["resultMime"] = "application/x-tf+xml+gz";
+      idilia::preparePost(*req, hostname, "/1/text/disambiguate.mpjson",
+          "application/x-www-form-urlencoded; charset=UTF-8", idilia::convertToQueryParms(arena, parms), text);
+
+      req->onDone = [this, key, result](idilia::AsyncRequest & disReq, CURLcode cc, long httpCode) {
+        idilia::MultipartHttpResponse response(disReq.arena);
+        if (httpCode != 200 || !response.parse(disReq.response.view()) || response.parts.size() != 2)
+        {
+          cerr << "Could not obtain sense analysis results: " << (cc != CURLE_OK ? curl_easy_strerror(cc) : disReq.response.str()) << endl;
+          return done(key, result, TaggingMenuPtr());
+        }
+        try
+        {
+          fetchMenu(key, result, response.parts[1]);
+        }
+        catch (const std::exception & e)
+        {
+          cerr << "Could not request tagging menu: " << e.what() << endl;
+          done(key, result, TaggingMenuPtr());
+        }
+      };
+      transport_.submit(move(req));
+    }
+    catch (const std::exception & e)
+    {
+      cerr << "Could not request sense analysis results: " << e.what() << endl;
+      done(key, result, TaggingMenuPtr());
+    }
+    return future;
+  }
+
+  // Obtain the tagging menu by sending the result of the sense analysis.
+  // Called on the thread of the transport. Throws if the request cannot be made.
+  void fetchMenu(const MenuKey & key, shared_ptr<promise<TaggingMenuPtr> > result, const idilia::MultipartHttpResponse::Part & tf)
+  {
+    unique_ptr<idilia::AsyncRequest> req(new idilia::AsyncRequest);
+    idilia::Arena & arena = req->arena;
+
+    // Create the multipart request with the data part the result part of text/disambiguate.
+    // The body is assembled in the request since the response holding the result goes away.
+    idilia::RequestParms parms(arena);
+    parms["filters"] = opts_.filters;
+    parms["template"] = opts_.menuTemplate;
+    idilia::MultipartHttpPostRequest menuReq(arena);
+    menuReq.addPart("application/x-www-form-urlencoded; charset=UTF-8", idilia::convertToQueryParms(arena, parms));
+    string_view tfBody = idilia::flatten(arena, tf.body);
+    menuReq.addPart(tf.headers, tfBody);
+    string_view body = menuReq.encoded();
+
+    idilia::preparePost(*req, hostname, "/1/kb/tagging_menu.json", menuReq.contentType, body, tfBody);
+    req->onDone = [this, key, result](idilia::AsyncRequest & menuReq, CURLcode cc, long httpCode) {
+      idilia::Arena & arena = menuReq.arena;
+      string_view json = idilia::flatten(arena, menuReq.response.view());
+      shared_ptr<TaggingMenu> menu = make_shared<TaggingMenu>();
+      if (httpCode != 200 || !idilia::jsonStringMember(json, "text", menu->text) || !idilia::jsonStringMember(json, "menu", menu->menu))
+      {
+        cerr << "Could not obtain tagging menu: " << (cc != CURLE_OK ? curl_easy_strerror(cc) : string(json)) << endl;
+        return done(key, result, TaggingMenuPtr());
+      }
+      cache_.put(key, menu);
+      done(key, result, menu);
+    };
+    transport_.submit(move(req));
+  }
+
+  void done(const MenuKey & key, shared_ptr<promise<TaggingMenuPtr> > result, TaggingMenuPtr menu)
+  {
+    {
+      lock_guard<mutex> lock(mutex_);
+      inFlight_.erase(key);
+    }
+    result->set_value(menu);
+  }
+
+  static const char * const hostname;
+
+  Options opts_;
+  mutex mutex_;
+  unordered_map<MenuKey, shared_future<TaggingMenuPtr>, MenuKeyHash> inFlight_; // protected by mutex_
+  idilia::LruCache<MenuKey, TaggingMenu, MenuKeyHash> cache_;
+  idilia::AsyncTransport transport_; // declared last: stopped before the members used by its callbacks are destroyed
+};
+
+const char * const TaggingMenuClient::hostname = "api.idilia.com";
+
+
+int main(int argc, char **argv)
+{
+  // Set your environment variables to the keys obtained from https://www.idilia.com/developer/my-projects
+
+  // Global initializations to do only once
+  curl_global_init(CURL_GLOBAL_ALL);
+
+  // Set the locale to English to get RFC2616 HTTP dates with English day names.
+  if (!setlocale(LC_ALL, "en_US.utf8"))
+    throw runtime_error("Could not set the locale to english. Needed for authentication.");
+
+  {
+    TaggingMenuClient client;
+
+    // When the document is loaded, start fetching the menus of all its words
+    string doc = "jaguar jungle food";
+    vector<MenuToken> tokens = client.prefetch(doc);
+
+    // Later, when the user opens the menus
+    for (size_t i = 0; i < tokens.size(); ++i)
+    {
+      TaggingMenuClient::TaggingMenuPtr menu = client.get(tokens[i]);
+      if (!menu)
+        throw std::runtime_error("Could not obtain the menu for " + tokens[i].surface);
+      cout << "Got HTML for word: " << menu->text << endl;
+      cout << "Got HTML for menu: " << menu->menu.length() << " characters" << endl;
+    }
+
+    // The words seen in the same context are now served from the cache
+    tokens = client.tokenize(doc);
+    for (size_t i = 0; i < tokens.size(); ++i)
+      cout << "Menu for [" << tokens[i].surface << "] " << (client.lookup(tokens[i].key) ? "is" : "is not") << " cached" << endl;
+  }
+
+  // Global cleanup done once
+  curl_global_cleanup();
+  return 0;
+}
@@ -0,0 +1,189 @@
+/*
+ * Example program using the coroutine client to process a file where each line
+ * is a search query. Each query is disambiguated and paraphrased; the semdoc is
+ * stored in a file with the pattern "query_<n>.semdoc.xml" where <n> is the file
+ * line number.
+ *
+ * Each query is handled by a coroutine written as straight-line code. All the
+ * queries are in flight at once on a single transport thread and a couple of
+ * executor threads instead of one thread per request. A coroutine is started
+ * only when fewer than twice --max-sim-req are in progress, so the memory used
+ * does not grow with the size of the input file.
+ *
+ * With --record the requests and responses are saved in a trace that can be
+ * replayed offline with trace_replay.
+ *
+ * Each endpoint has a circuit breaker: when the service degrades, the remaining
+ * queries fail at once instead of piling up. With --stale-cache up to that many MB
+ * of responses are kept and those of the queries already seen are used while the
+ * breaker is open.
+ *
+ * Environment variables IDILIA_ACCESS_KEY and IDILIA_PRIVATE_KEY must be set
+ * to the keys obtained from https://www.idilia.com/developer/my-projects
+ *
+ * Requires the RPMs: mhash-devel curl-devel libxml2-devel zlib-devel
+ *
+ * Compile with:
+ *   g++ -std=c++20 -pthread -o disambiguate_coro -I /usr/include/libxml2 -lxml2 -lmhash -lcurl -lz disambiguate_coro.cc
+ *
+ * Run with:
+ *   ./disambiguate_coro --input-file=queries.txt --output-dir=/tmp [--record=/tmp/idilia.trace] [--stale-cache=<MB>]
+ */
+
+#include "../common/circuit_breaker.h"
+#include "../common/coro.h"
+#include "../common/coro_client.h"
+#include "../common/query_file.h"
+#include "../common/trace.h"
+
+#include <curl/curl.h>
+
+#include <sys/stat.h>
+
+#include <string>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+
+static mutex outputMutex;
+
+
+// Process one query as a sequence of calls. Releases a permit of inProgress when done.
+static idilia::Task<> processQuery(idilia::CoroClient & client, idilia::Semaphore & inProgress, string query, string oFile,
+    atomic<size_t> & numFailed, atomic<size_t> & numFailedFast)
+{
+  try
+  {
+    string semdoc = co_await client.disambiguate(query, "text/query; charset=UTF-8");
+    {
+      ofstream os((oFile + "~").c_str(), ios::binary | ios::trunc);
+      os << semdoc;
+    }
+    rename((oFile + "~").c_str(), oFile.c_str());
+
+    string paraphrases = co_await client.paraphrase(query, 5);
+
+    size_t numParaphrases = 0;
+    for (size_t pos = 0; (pos = paraphrases.find("<paraphrase", pos)) != string::npos; ++pos)
+      if (paraphrases[pos + 11] == '>' || paraphrases[pos + 11] == ' ')
+        ++numParaphrases;
+    lock_guard<mutex> lock(outputMutex);
+    cout << query << ": " << semdoc.length() << " bytes of semdoc, " << numParaphrases << " paraphrases" << endl;
+  }
+  catch (const idilia::CircuitOpenError & e)
+  {
+    ++numFailedFast;
+  }
+  catch (const std::exception & e)
+  {
+    ++numFailed;
+    lock_guard<mutex> lock(outputMutex);
+    cerr << "Failed to process " << query << ": " << e.what() << endl;
+  }
+  inProgress.release();
+}
+
+
+int main(int argc, char **argv)
+{
+  // Set your environment variables to the keys obtained from https://www.idilia.com/developer/my-projects
+
+  string iFile;           // Input file with all the queries
+  string outDir;          // Output directory where output for each query is stored
+  string traceFile;       // Trace of the requests to record
+  unsigned maxSimReq = 100; // Number of simultaneous requests. Limited by project profile associated with keys.
+  size_t staleCacheMB = 0; // Size of the responses kept to answer while a breaker is open
+  for (int i = 1; i < argc; ++i)
+  {
+    string arg(argv[i]);
+    if (arg.compare(0, 13, "--input-file=") == 0)
+      iFile = arg.substr(13);
+    else if (arg.compare(0, 13, "--output-dir=") == 0)
+      outDir = arg.substr(13);
+    else if (arg.compare(0, 14, "--max-sim-req=") == 0)
+      maxSimReq = max(1, atoi(arg.c_str() + 14));
+    else if (arg.compare(0, 9, "--record=") == 0)
+      traceFile = arg.substr(9);
+    else if (arg.compare(0, 14, "--stale-cache=") == 0)
+      staleCacheMB = strtoul(arg.c_str() + 14, 0, 10);
+    else
+    {
+      cerr << "Usage: " << argv[0] << " --input-file=<file> --output-dir=<dir> [--max-sim-req=<n>] [--record=<file>] [--stale-cache=<MB>]" << endl;
+      return 1;
+    }
+  }
+  if (iFile.empty())
+    throw runtime_error("You must provide an input file using --input-file");
+  if (outDir.empty())
+    throw runtime_error("You must provide an output directory using --output-dir");
+
+  // Global initializations to do only once
+  curl_global_init(CURL_GLOBAL_ALL);
+
+  // Set the locale to English to get RFC2616 HTTP dates with English day names.
+  if (!setlocale(LC_ALL, "en_US.utf8"))
+    throw runtime_error("Could not set the locale to english. Needed for authentication.");
+
+  // Ensure that output directory exists
+  mkdir(outDir.c_str(), 0777);
+
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  size_t numQueries = 0;
+  atomic<size_t> numFailed(0), numFailedFast(0);
+  idilia::CircuitBreakers breakers;
+  unique_ptr<idilia::ResponseCache> staleCache(staleCacheMB ? new idilia::ResponseCache(staleCacheMB << 20) : 0);
+  {
+    unique_ptr<idilia::TraceWriter> trace(traceFile.empty() ? 0 : new idilia::TraceWriter(traceFile));
+    idilia::Executor executor(2);
+    idilia::CoroClient client(executor, maxSimReq);
+    client.protect(breakers, staleCache.get());
+    if (trace)
+      client.transport().observe([&trace](idilia::AsyncRequest & req, CURLcode cc, long httpCode) {
+        if (req.admission != idilia::CircuitBreaker::rejected) // not sent
+          trace->record(req.curl, req.submitted, req.headers, req.body, httpCode, req.response.view());
+      });
+
+    // Start a coroutine per query, waiting for a permit so that the queries read ahead are bounded
+    idilia::Semaphore inProgress(executor, 2 * maxSimReq);
+    idilia::MappedQueryFile input(iFile);
+    idilia::QueryChunk chunk;
+    while (input.nextChunk(chunk))
+    {
+      idilia::QueryLineCursor cursor(chunk, true, true);
+      for (idilia::QueryLine line; cursor.next(line); ++numQueries)
+      {
+        stringstream oFile; oFile << outDir << "/query_" << line.lineNo << ".semdoc.xml";
+        inProgress.acquireBlocking();
+        executor.spawn(processQuery(client, inProgress, string(line.text), oFile.str(), numFailed, numFailedFast));
+      }
+      input.doneChunk(chunk);
+    }
+
+    executor.wait();
+  }
+
+  cout << "Processed " << numQueries << " queries in "
+       << chrono::duration<double>(chrono::steady_clock::now() - start).count() << "s";
+  if (numFailed)
+    cout << ", " << numFailed << " failed";
+  if (numFailedFast)
+    cout << ", " << numFailedFast << " failed fast";
+  cout << endl;
+  breakers.forEach([](const string & endpoint, const idilia::CircuitBreaker & breaker) {
+    if (breaker.numTrips())
+      cout << "Circuit of " << endpoint << " opened " << breaker.numTrips() << " times, "
+           << breaker.numRejected() << " requests failed fast" << endl;
+  });
+
+  // Global cleanup done once
+  curl_global_cleanup();
+  return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * Example program disambiguating successive versions of a document as an editor
+ * revises it.
+ *
+ * The first version is disambiguated in full, in segments sent concurrently.
+ * For the following versions, only the paragraphs and sentences that were edited
+ * are sent again, with some surrounding text for context; the senses of the
+ * others come from a cache and all are spliced with offsets in the new version.
+ * The senses of the last version are printed as "<offset> <length> <sense key> <words>".
+ *
+ * With --parse-threads the responses are parsed on a work-stealing pool of that
+ * many threads instead of the transport's thread.
+ *
+ * Environment variables IDILIA_ACCESS_KEY and IDILIA_PRIVATE_KEY must be set
+ * to the keys obtained from https://www.idilia.com/developer/my-projects
+ *
+ * Requires the RPMs: mhash-devel curl-devel libxml2-devel
+ *
+ * Compile with:
+ *   g++ -std=c++17 -pthread -o disambiguate_incremental -I /usr/include/libxml2 -lxml2 -lmhash -lcurl disambiguate_incremental.cc
+ *
+ * Run with:
+ *   ./disambiguate_incremental --input-file=doc_v1.txt --input-file=doc_v2.txt [--input-file=...] [--text-mime=<mime>] [--parse-threads=<n>]
+ */
+
+#include "../common/incremental.h"
+#include "../common/senses.h"
+#include "../common/work_pool.h"
+
+#include <libxml/parser.h>
+
+#include <curl/curl.h>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+
+static string readFile(const string & fn)
+{
+  ifstream is(fn.c_str(), ios::binary);
+  if (!is)
+    throw runtime_error("Could not open " + fn);
+  stringstream ss;
+  ss << is.rdbuf();
+  return ss.str();
+}
+
+
+int main(int argc, char **argv)
+{
+  // Set your environment variables to the keys obtained from https://www.idilia.com/developer/my-projects
+
+  vector<string> inputFiles; // the versions of the document, in order
+  idilia::IncrementalDisambiguator::Options options;
+  unsigned numParseThreads = 0; // Threads parsing the responses. On the transport's thread when 0.
+  for (int i = 1; i < argc; ++i)
+  {
+    string arg(argv[i]);
+    if (arg.compare(0, 13, "--input-file=") == 0)
+      inputFiles.push_back(arg.substr(13));
+    else if (arg.compare(0, 12, "--text-mime=") == 0)
+      options.textMime = arg.substr(12);
+    else if (arg.compare(0, 16, "--parse-threads=") == 0)
+      numParseThreads = atoi(arg.c_str() + 16);
+    else
+    {
+      cerr << "Usage: " << argv[0] << " --input-file=<file> [--input-file=<edited file> ...] [--text-mime=<mime>] [--parse-threads=<n>]" << endl;
+      return 1;
+    }
+  }
+  if (inputFiles.empty())
+    throw runtime_error("You must provide the versions of the document using --input-file");
+
+  // Global initializations to do only once
+  curl_global_init(CURL_GLOBAL_ALL);
+  idilia::installXmlArenaHooks();
+  LIBXML_TEST_VERSION;
+
+  // Set the locale to English to get RFC2616 HTTP dates with English day names.
+  if (!setlocale(LC_ALL, "en_US.utf8"))
+    throw runtime_error("Could not set the locale to english. Needed for authentication.");
+
+  idilia::SenseKeyDictionary dict;
+  string text;
+  idilia::CompactSenses senses;
+  {
+    unique_ptr<idilia::WorkStealingPool> parsers;
+    if (numParseThreads)
+      parsers.reset(new idilia::WorkStealingPool(numParseThreads));
+    idilia::IncrementalDisambiguator disambiguator(dict, options, parsers.get());
+    for (size_t v = 0; v < inputFiles.size(); ++v)
+    {
+      text = readFile(inputFiles[v]);
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      idilia::IncrementalDisambiguator::Stats stats = disambiguator.disambiguate(text, senses);
+      double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      cout << inputFiles[v] << ": " << stats.numSegments << " segments, " << stats.numReused << " reused, "
+           << stats.numSent << " sent in " << stats.numRequests << " requests (" << stats.bytesSent << " of "
+           << text.length() << " bytes), " << senses.size() << " senses in " << elapsed << "s" << endl;
+    }
+  }
+
+  for (size_t i = 0; i < senses.size(); ++i)
+    cout << senses[i].offset << ' ' << senses[i].length << ' ' << dict.senseKey(senses[i].senseId) << ' '
+         << text.substr(senses[i].offset, senses[i].length) << endl;
+
+  // Global cleanup done once
+  xmlCleanupParser();
+  curl_global_cleanup();
+  return 0;
+}
@@ -0,0 +1,207 @@
+/*
+ * Example program to issue disambiguate.xml requests to process a file that contains several lines
+ * where each line is a search query. The result for each line is stored in a file
+ * with the pattern "query_<n>.semdoc.xml" where <n> is the file line number.
+ * Several documents are processed at once using multiple threads.
+ * Program can be re-ran multiple times if necessary.
+ *
+ * The input file is memory mapped and split in chunks handed out to the threads
+ * so that arbitrarily large files can be processed without loading them in memory.
+ * Empty lines and lines that are not valid UTF-8 are skipped.
+ * Each thread allocates the objects of its requests in an arena released after each request.
+ *
+ * Environment variables IDILIA_ACCESS_KEY and IDILIA_PRIVATE_KEY must be set
+ * to the keys obtained from https://www.idilia.com/developer/my-projects
+ *
+ * Requires the RPMs: mhash-devel curl-devel libxml2-devel
+ *
+ * Compile with:
+ *   g++ -std=c++17 -pthread -o disambiguate_multiple -I /usr/include/libxml2 -lxml2 -lmhash -lcurl disambiguate_multiple.cc
+ *
+ * Run with:
+ *   ./disambiguate_multiple --input-file=queries.txt --output-dir=/tmp
+ */
+
+#include "../common/endpoints.h"
+#include "../common/http.h"
+#include "../common/query_file.h"
+
+#include <libxml/parser.h>
+
+#include <curl/curl.h>
+#include <curl/easy.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+
+static bool fileExists(const string & fn)
+{
+  struct stat st;
+  return stat(fn.c_str(), &st) == 0;
+}
+
+
+static void writeFile(const string & fn, const idilia::ResponseBuffer & content)
+{
+  ofstream os(fn.c_str(), ios::binary | ios::trunc);
+  os << content;
+}
+
+
+// Helper function to obtain the WSD results for the given query.
+// Returns the HTTP status code or 0 when the request could not be sent.
+long disambiguateQuery(idilia::Arena & arena, CURL * curl, const string & oFile, string_view qry, string_view reqId)
+{
+  // Check if the document already exists or we already determined that it can't be computed
+  if (fileExists(oFile))
+    return 200;
+  if (fileExists(oFile + ".400") || fileExists(oFile + ".500"))
+    return 500;
+
+  // Parameters for the request
+  typedef idilia::DisambiguateXml Endpoint;
+  idilia::EndpointRequest<Endpoint> req;
+  req.set<Endpoint::requestId>(reqId);
+  req.set<Endpoint::text>(qry);
+  req.set<Endpoint::textMime>("text/query; charset=UTF-8");
+  req.setup(arena, curl);
+  curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "gzip");
+
+  idilia::ResponseBuffer response(arena);
+  response.setup(curl);
+
+  CURLcode cc = curl_easy_perform(curl);
+  if (cc != CURLE_OK)
+  {
+    cerr << "Got error during wsd for reqId: " << reqId << ": " << curl_easy_strerror(cc) << endl;
+    return 0;
+  }
+
+  long httpCode = 0;
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpCode);
+  if (httpCode != 200)
+  {
+    cerr << "Got error code during wsd for reqId: " << reqId << " response: " << httpCode << '\n' << response << endl;
+    if (httpCode == 400)
+      // Something wrong with this request. Create a file with error message
+      // so that we don't reattempt.
+      writeFile(oFile + ".400", response);
+    else if (httpCode >= 500)
+      // Server could not process. Save error message.
+      writeFile(oFile + ".500", response);
+    return httpCode;
+  }
+
+  // Write the file
+  writeFile(oFile + "~", response);
+  rename((oFile + "~").c_str(), oFile.c_str());
+  return httpCode;
+}
+
+
+// Processes the chunks of the input file until all have been claimed.
+// Each worker reuses a single CURL handle and therefore its connection to the server.
+void worker(unsigned thr, idilia::MappedQueryFile & input, const string & outDir, atomic<size_t> & numInvalid)
+{
+  CURL * curl = 0;
+  idilia::Arena arena;
+  unsigned reqNum = 0;
+  idilia::QueryChunk chunk;
+  while (input.nextChunk(chunk))
+  {
+    idilia::QueryLineCursor cursor(chunk, true, true);
+    for (idilia::QueryLine line; cursor.next(line); )
+    {
+      stringstream reqId; reqId << "r-" << thr << '-' << ++reqNum;
+      stringstream oFile; oFile << outDir << "/query_" << line.lineNo << ".semdoc.xml";
+      for (int attempt = 0; attempt < 2; ++attempt)
+      {
+        if (!curl && !(curl = curl_easy_init()))
+          throw std::runtime_error("Could not obtain CURL handle");
+        long httpCode = disambiguateQuery(arena, curl, oFile.str(), line.text, reqId.str());
+        arena.release();
+        if (httpCode != 0)
+          break;
+
+        // Connection problem. Start over with a new handle.
+        curl_easy_cleanup(curl);
+        curl = 0;
+        sleep(1);
+      }
+    }
+    numInvalid += cursor.numInvalid();
+    input.doneChunk(chunk);
+  }
+  if (curl)
+    curl_easy_cleanup(curl);
+}
+
+
+int main(int argc, char **argv)
+{
+  // Set your environment variables to the keys obtained from https://www.idilia.com/developer/my-projects
+
+  string iFile;           // Input file with all the queries
+  string outDir;          // Output directory where output for each query is stored
+  unsigned maxSimReq = 100; // Number of simultaneous requests. Limited by project profile associated with keys.
+  for (int i = 1; i < argc; ++i)
+  {
+    string arg(argv[i]);
+    if (arg.compare(0, 13, "--input-file=") == 0)
+      iFile = arg.substr(13);
+    else if (arg.compare(0, 13, "--output-dir=") == 0)
+      outDir = arg.substr(13);
+    else if (arg.compare(0, 14, "--max-sim-req=") == 0)
+      maxSimReq = max(1, atoi(arg.c_str() + 14));
+    else
+    {
+      cerr << "Usage: " << argv[0] << " --input-file=<file> --output-dir=<dir> [--max-sim-req=<n>]" << endl;
+      return 1;
+    }
+  }
+  if (iFile.empty())
+    throw runtime_error("You must provide an input file using --input-file");
+  if (outDir.empty())
+    throw runtime_error("You must provide an output directory using --output-dir");
+
+  // Global initializations to do only once
+  curl_global_init(CURL_GLOBAL_ALL);
+  idilia::installXmlArenaHooks();
+  LIBXML_TEST_VERSION;
+
+  // Set the locale to English to get RFC2616 HTTP dates with English day names.
+  if (!setlocale(LC_ALL, "en_US.utf8"))
+    throw runtime_error("Could not set the locale to english. Needed for authentication.");
+
+  // Ensure that output directory exists
+  mkdir(outDir.c_str(), 0777);
+
+  // Map the input and disambiguate all its lines using multiple threads
+  idilia::MappedQueryFile input(iFile, maxSimReq);
+  atomic<size_t> numInvalid(0);
+  vector<thread> threads;
+  for (unsigned thr = 0; thr < maxSimReq && thr < input.numChunks(); ++thr)
+    threads.push_back(thread(worker, thr, ref(input), cref(outDir), ref(numInvalid)));
+  for (size_t i = 0; i < threads.size(); ++i)
+    threads[i].join();
+
+  if (numInvalid)
+    cerr << "Skipped " << numInvalid << " lines that are not valid UTF-8" << endl;
+
+  // Global cleanup done once
+  xmlCleanupParser();
+  curl_global_cleanup();
+  return 0;
+}
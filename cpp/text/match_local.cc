@@ -0,0 +1,153 @@
+/*
+ * Example program matching many sense filters against a stream of tweets locally.
+ *
+ * match.json takes one filter per request: monitoring hundreds of filters would
+ * require as many requests per message. Instead each message is disambiguated once
+ * with disambiguate.xml, the senses found are kept in a compact form in a cache,
+ * and all the filters are evaluated locally with an index of the filters by word.
+ * The output has the matches/foundSk semantics of match.json, with the differences
+ * noted in sense_filter.h.
+ *
+ * Environment variables IDILIA_ACCESS_KEY and IDILIA_PRIVATE_KEY must be set
+ * to the keys obtained from https://www.idilia.com/developer/my-projects
+ *
+ * Requires the RPMs: mhash-devel curl-devel libxml2-devel
+ *
+ * Compile with:
+ *   g++ -std=c++17 -o match_local -I /usr/include/libxml2 -lxml2 -lmhash -lcurl match_local.cc
+ *
+ */
+
+#include "../common/endpoints.h"
+#include "../common/http.h"
+#include "../common/lru_cache.h"
+#include "../common/sense_filter.h"
+#include "../common/senses.h"
+#include "../common/xml.h"
+
+#include <libxml/parser.h>
+
+#include <curl/curl.h>
+#include <curl/easy.h>
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+
+// Obtain the senses of a text with disambiguate.xml
+static void disambiguate(CURL * curl, const string & text, idilia::SenseKeyDictionary & dict, idilia::CompactSenses & senses)
+{
+  typedef idilia::DisambiguateXml Endpoint;
+  idilia::Arena arena;
+  idilia::EndpointRequest<Endpoint> req;
+  req.set<Endpoint::text>(text);
+  req.set<Endpoint::textMime>("text/tweet; charset=UTF-8");
+  req.setup(arena, curl);
+  curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+
+  idilia::ResponseBuffer response(arena);
+  response.setup(curl);
+
+  CURLcode cc = curl_easy_perform(curl);
+  if (cc != CURLE_OK)
+  {
+    stringstream ss; ss << curl_easy_strerror(cc);
+    throw std::runtime_error(ss.str());
+  }
+
+  long httpCode = 0;
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpCode);
+  if (httpCode != 200)
+  {
+    stringstream ss; ss << httpCode << ' ' << response;
+    throw std::runtime_error(ss.str());
+  }
+
+  idilia::XmlArenaScope xmlScope(arena);
+  xmlDocPtr doc = idilia::readXmlDoc(response.view());
+  if (!doc)
+    throw std::runtime_error("Could not recover semdoc format");
+  idilia::extractSenses(doc, text, dict, senses);
+  xmlFreeDoc(doc);
+}
+
+
+int main(int argc, char **argv)
+{
+  // Set your environment variables to the keys obtained from https://www.idilia.com/developer/my-projects
+
+  // Global initializations to do only once
+  curl_global_init(CURL_GLOBAL_ALL);
+  idilia::installXmlArenaHooks();
+  LIBXML_TEST_VERSION;
+
+  // Set the locale to English to get RFC2616 HTTP dates with English day names.
+  if (!setlocale(LC_ALL, "en_US.utf8"))
+    throw runtime_error("Could not set the locale to english. Needed for authentication.");
+
+  // The messages that we will process. The same message is often seen several times (retweets).
+  vector<string> texts = {
+    "RT @blecklerr: just saw a southern tide decal on a nissan with dark tint and the biggest shiniest rims. #theyreconfused #WhatsGoingOnHere",
+    "In honor of the Crimson Tide, here's the song of the day. Welcome to Miami, vien bonito amiami !! See you at... http://t.co/vdkan4mN",
+    "RT @blecklerr: just saw a southern tide decal on a nissan with dark tint and the biggest shiniest rims. #theyreconfused #WhatsGoingOnHere",
+  };
+
+  // The filters monitored, as would be given to match.json
+  vector<string> filters = {
+    "{\"fsk\":\"tide/N1\"}",
+    "{\"fsk\":\"tide/N2\"}",
+    "{\"fsk\":\"nissan/N1\"}",
+    "{\"fsk\":\"Miami/N1\"}",
+  };
+
+  idilia::SenseKeyDictionary dict;
+  idilia::SenseFilterIndex index(dict);
+  for (size_t i = 0; i < filters.size(); ++i)
+    if (!index.addFilter(i, filters[i]))
+      throw runtime_error("Not a sense filter: " + filters[i]);
+
+  // Cache of the senses of the messages already disambiguated
+  idilia::LruCache<string, idilia::CompactSenses> cache(10000);
+
+  CURL * curl = curl_easy_init();
+  if (!curl)
+    throw std::runtime_error("Could not obtain CURL handle");
+
+  for (size_t t = 0; t < texts.size(); ++t)
+  {
+    idilia::LruCache<string, idilia::CompactSenses>::ValuePtr senses = cache.get(texts[t]);
+    if (!senses)
+    {
+      shared_ptr<idilia::CompactSenses> found = make_shared<idilia::CompactSenses>();
+      disambiguate(curl, texts[t], dict, *found);
+      cache.put(texts[t], found);
+      senses = found;
+    }
+
+    // Print the response that match.json would have given for each filter with a word match
+    cout << texts[t] << endl;
+    index.match(*senses, [&](uint32_t filter, const vector<idilia::LocalMatch> & matches) {
+      cout << "  " << filters[filter] << " {\"matches\":[";
+      for (size_t i = 0; i < matches.size(); ++i)
+      {
+        cout << (i ? "," : "") << "{\"position\":[" << matches[i].offset << ',' << matches[i].length << ']';
+        if (matches[i].foundSenseId != idilia::SenseKeyDictionary::npos)
+          cout << ",\"foundSk\":\"" << dict.senseKey(matches[i].foundSenseId) << '"';
+        cout << '}';
+      }
+      cout << "]}" << endl;
+    });
+  }
+
+  curl_easy_cleanup(curl);
+
+  // Global cleanup done once
+  xmlCleanupParser();
+  curl_global_cleanup();
+  return 0;
+}
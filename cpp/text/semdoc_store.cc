@@ -0,0 +1,193 @@
+/*
+ * Example program to keep disambiguation results in a ResultStore and query them by sense.
+ *
+ * Imports the "query_<n>.semdoc.xml" files written by disambiguate_multiple into
+ * the store, keyed by the line number <n>, then answers queries such as
+ * "all the queries that resolved to sense X" from the store's inverted index
+ * without reparsing the semdocs. The semdocs are parsed on all the CPUs: the
+ * sense ids and the order of the records in the store depend on the scheduling
+ * of the threads, the answers to the queries do not.
+ *
+ * Requires the RPMs: libxml2-devel zlib-devel
+ *
+ * Compile with:
+ *   g++ -std=c++17 -pthread -o semdoc_store -I /usr/include/libxml2 -lxml2 -lz semdoc_store.cc
+ *
+ * Run with:
+ *   ./semdoc_store --store-dir=/tmp/store --import-dir=/tmp --input-file=queries.txt [--threads=<n>]
+ *   ./semdoc_store --store-dir=/tmp/store --sense=hockey/N1
+ *   ./semdoc_store --store-dir=/tmp/store --get=3
+ * The exit status is 2 when a query asked with --get is not in the store.
+ */
+
+#include "../common/arena.h"
+#include "../common/query_file.h"
+#include "../common/result_store.h"
+#include "../common/senses.h"
+#include "../common/work_pool.h"
+#include "../common/xml.h"
+
+#include <libxml/parser.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+
+// Import the semdoc files of a directory. The text of the queries, when given,
+// is used to locate the senses found. The files are parsed in parallel by the pool.
+static size_t importSemdocs(idilia::ResultStore & store, idilia::WorkStealingPool & pool, const string & dir, const string & iFile)
+{
+  unordered_map<uint64_t, string_view> texts;
+  unique_ptr<idilia::MappedQueryFile> input;
+  if (!iFile.empty())
+  {
+    input.reset(new idilia::MappedQueryFile(iFile));
+    idilia::QueryChunk chunk;
+    while (input->nextChunk(chunk))
+    {
+      idilia::QueryLineCursor cursor(chunk, true, false);
+      for (idilia::QueryLine line; cursor.next(line); )
+        texts[line.lineNo] = line.text;
+    }
+  }
+
+  DIR * d = opendir(dir.c_str());
+  if (!d)
+    throw runtime_error("Could not open " + dir);
+
+  atomic<size_t> numImported(0);
+  for (struct dirent * ent; (ent = readdir(d)); )
+  {
+    unsigned long long lineNo;
+    int len = 0;
+    if (sscanf(ent->d_name, "query_%llu.semdoc.xml%n", &lineNo, &len) != 1 || ent->d_name[len] != 0)
+      continue;
+
+    string fn(ent->d_name);
+    pool.submit([&store, &texts, &numImported, dir, fn, lineNo](idilia::WorkerContext & ctx) {
+      ifstream is((dir + '/' + fn).c_str(), ios::binary);
+      stringstream ss; ss << is.rdbuf();
+      string content = ss.str();
+
+      string_view seg(content);
+      size_t offset = 0;
+      idilia::RopeView rope(&seg, &offset, 1, 0, seg.length());
+      xmlDocPtr doc = idilia::readXmlDoc(ctx.xmlParser, rope);
+      if (!doc)
+      {
+        cerr << "Skipping " << fn << ": not well formed" << endl;
+        return;
+      }
+      idilia::CompactSenses senses;
+      unordered_map<uint64_t, string_view>::const_iterator text = texts.find(lineNo);
+      idilia::extractSenses(doc, text != texts.end() ? text->second : string_view(), store.dictionary(), senses);
+      xmlFreeDoc(doc);
+
+      store.put(lineNo, senses, content);
+      ++numImported;
+    });
+  }
+  closedir(d);
+  pool.wait();
+  store.flush();
+  return numImported;
+}
+
+
+int main(int argc, char **argv)
+{
+  string storeDir;  // Directory of the store
+  string importDir; // Directory with the semdoc files to import
+  string iFile;     // Input file with the queries of the semdocs
+  vector<string> senses;
+  vector<uint64_t> gets;
+  unsigned numThreads = 0;  // Threads parsing the semdocs. One per CPU when 0.
+  for (int i = 1; i < argc; ++i)
+  {
+    string arg(argv[i]);
+    if (arg.compare(0, 12, "--store-dir=") == 0)
+      storeDir = arg.substr(12);
+    else if (arg.compare(0, 13, "--import-dir=") == 0)
+      importDir = arg.substr(13);
+    else if (arg.compare(0, 13, "--input-file=") == 0)
+      iFile = arg.substr(13);
+    else if (arg.compare(0, 8, "--sense=") == 0)
+      senses.push_back(arg.substr(8));
+    else if (arg.compare(0, 6, "--get=") == 0)
+      gets.push_back(strtoull(arg.c_str() + 6, 0, 10));
+    else if (arg.compare(0, 10, "--threads=") == 0)
+      numThreads = atoi(arg.c_str() + 10);
+    else
+    {
+      cerr << "Usage: " << argv[0] << " --store-dir=<dir> [--import-dir=<dir> [--input-file=<file>]] [--sense=<sk>]... [--get=<line>]... [--threads=<n>]" << endl;
+      return 1;
+    }
+  }
+  if (storeDir.empty())
+    throw runtime_error("You must provide the store directory using --store-dir");
+  mkdir(storeDir.c_str(), 0755);
+
+  // Global initializations to do only once
+  idilia::installXmlArenaHooks();
+  LIBXML_TEST_VERSION;
+
+  size_t numNotFound = 0;
+  {
+    idilia::ResultStore store(storeDir);
+
+    if (!importDir.empty())
+    {
+      idilia::WorkStealingPool pool(numThreads);
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      size_t n = importSemdocs(store, pool, importDir, iFile);
+      cout << "Imported " << n << " semdocs in "
+           << chrono::duration<double>(chrono::steady_clock::now() - start).count() << "s with "
+           << pool.numWorkers() << " threads" << endl;
+    }
+
+    for (size_t i = 0; i < senses.size(); ++i)
+    {
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      vector<uint64_t> lines;
+      store.forEachWithSense(senses[i], [&lines](uint64_t lineNo) { lines.push_back(lineNo); });
+      cout << "Sense " << senses[i] << " found in " << lines.size() << " queries ("
+           << chrono::duration<double>(chrono::steady_clock::now() - start).count() << "s):";
+      for (size_t j = 0; j < lines.size() && j < 20; ++j)
+        cout << ' ' << lines[j];
+      cout << (lines.size() > 20 ? " ..." : "") << endl;
+    }
+
+    for (size_t i = 0; i < gets.size(); ++i)
+    {
+      idilia::StoredResult res;
+      if (!store.get(gets[i], res))
+      {
+        cout << "Query " << gets[i] << " not found" << endl;
+        numNotFound += 1;
+        continue;
+      }
+      cout << "Query " << gets[i] << ":";
+      for (size_t j = 0; j < res.senses.size(); ++j)
+        cout << ' ' << store.dictionary().senseKey(res.senses[j].senseId)
+             << '@' << res.senses[j].offset << ':' << res.senses[j].length;
+      cout << " (" << res.payload.length() << " bytes of semdoc)" << endl;
+    }
+  }
+
+  // Global cleanup done once
+  xmlCleanupParser();
+  return numNotFound ? 2 : 0;
+}
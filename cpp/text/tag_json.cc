@@ -0,0 +1,422 @@
+/*
+ * Example program to tag a continuous stream of short texts (e.g. tweets) with tag.json using libcurl.
+ *
+ * Sending one request per tweet pays the request overhead (headers, signature,
+ * round trip, server-side setup) for a few words of text. Instead the messages
+ * are accumulated in micro-batches sent as a single HTML document where each
+ * message is its own block. A message alone is sent the same way so that its tags
+ * do not depend on the batch it falls in. A batch is sent when it is full or when its oldest
+ * message has waited for the latency budget. The tagged document returned is split
+ * back into the messages and the results are delivered through a callback.
+ * When the tagged document cannot be split, the messages of the batch are resent individually.
+ *
+ * Environment variables IDILIA_ACCESS_KEY and IDILIA_PRIVATE_KEY must be set
+ * to the keys obtained from https://www.idilia.com/developer/my-projects
+ *
+ * Requires the RPMs: mhash-devel curl-devel libxml2-devel
+ *
+ * Compile with:
+ *   g++ -std=c++17 -pthread -o tag_json -I /usr/include/libxml2 -lxml2 -lmhash -lcurl tag_json.cc
+ *
+ * Run with:
+ *   ./tag_json < tweets.txt
+ * where each line of the input is a message. Without input a few sample tweets are tagged.
+ */
+
+#include "../common/http.h"
+#include "../common/json.h"
+#include "../common/transport.h"
+
+#include <curl/curl.h>
+
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <stdexcept>
+#include <iostream>
+
+using namespace std;
+
+
+// A word tagged with a sense
+struct Tag
+{
+  string surface; // text of the tagged word
+  string fsk;     // its sense
+};
+
+// The result of tagging one message
+struct TagResult
+{
+  uint64_t id;       // identifier given when the message was submitted
+  bool ok;
+  string error;      // when not ok
+  string taggedText; // the message with the markup of the tags
+  vector<Tag> tags;
+};
+
+
+// Client micro-batching the messages submitted from any thread.
+// Results are delivered on the thread of the transport.
+class TagStreamClient
+{
+public:
+  typedef function<void(const TagResult & res)> ResultFn;
+
+  struct Options
+  {
+    Options() : maxBatchMessages(64), maxBatchBytes(32 << 10), maxDelay(50), maxConcurrent(4),
+      repeatPolicy("tagRepeats"), markup("infocard,schemaOrg,title") {}
+    size_t maxBatchMessages;
+    size_t maxBatchBytes;               // text bytes in a batch
+    chrono::milliseconds maxDelay;      // latency budget of a message before its batch is sent
+    unsigned maxConcurrent;             // number of batches sent simultaneously
+    string repeatPolicy;
+    string markup;
+  };
+
+  TagStreamClient(ResultFn onResult, const Options & opts = Options()) :
+    opts_(opts), onResult_(onResult), stop_(false), bytes_(0), outstanding_(0), transport_(opts.maxConcurrent)
+  {
+    timer_ = thread(&TagStreamClient::timerLoop, this);
+  }
+
+  // Sends what is pending and waits for all the results
+  ~TagStreamClient()
+  {
+    {
+      unique_lock<mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cond_.notify_all();
+    timer_.join();
+    flush();
+
+    unique_lock<mutex> lock(mutex_);
+    doneCond_.wait(lock, [this] { return outstanding_ == 0; });
+  }
+
+  // Queue a message. Thread safe.
+  void submit(uint64_t id, string text)
+  {
+    vector<Message> full;
+    {
+      lock_guard<mutex> lock(mutex_);
+      if (pending_.empty())
+        oldest_ = chrono::steady_clock::now();
+      bytes_ += text.length();
+      pending_.push_back(Message{id, move(text)});
+      if (pending_.size() >= opts_.maxBatchMessages || bytes_ >= opts_.maxBatchBytes)
+        full = takePending();
+      else if (pending_.size() == 1)
+        cond_.notify_all(); // start timing the batch
+    }
+    if (!full.empty())
+      send(move(full));
+  }
+
+  // Send the pending messages without waiting for the latency budget
+  void flush()
+  {
+    vector<Message> batch;
+    {
+      lock_guard<mutex> lock(mutex_);
+      batch = takePending();
+    }
+    if (!batch.empty())
+      send(move(batch));
+  }
+
+private:
+  struct Message
+  {
+    uint64_t id;
+    string text;
+  };
+
+  // Called with mutex_ held
+  vector<Message> takePending()
+  {
+    vector<Message> batch;
+    batch.swap(pending_);
+    bytes_ = 0;
+    return batch;
+  }
+
+  // Sends the batches whose oldest message exhausted the latency budget
+  void timerLoop()
+  {
+    unique_lock<mutex> lock(mutex_);
+    while (!stop_)
+    {
+      if (pending_.empty())
+      {
+        cond_.wait(lock);
+        continue;
+      }
+      chrono::steady_clock::time_point deadline = oldest_ + opts_.maxDelay;
+      if (chrono::steady_clock::now() < deadline)
+      {
+        cond_.wait_until(lock, deadline);
+        continue;
+      }
+      vector<Message> batch = takePending();
+      lock.unlock();
+      send(move(batch));
+      lock.lock();
+    }
+  }
+
+  static void escapeHtml(string & out, const string & s)
+  {
+    for (size_t i = 0; i < s.length(); ++i)
+    {
+      switch (s[i])
+      {
+      case '&': out += "&amp;"; break;
+      case '<': out += "&lt;"; break;
+      case '>': out += "&gt;"; break;
+      case '"': out += "&quot;"; break;
+      default: out += s[i];
+      }
+    }
+  }
+
+  static string messageMarker(size_t i)
+  {
+    return "<div id=\"idl-msg-" + to_string(i) + "\">";
+  }
+
+  // Send a batch in one request. Does not throw: the messages of a batch that could not
+  // be sent are completed with the error, as the timer and the destructor send batches.
+  void send(vector<Message> batch)
+  {
+    shared_ptr<vector<Message> > msgs = make_shared<vector<Message> >(move(batch));
+    bool counted = false;
+    try
+    {
+      unique_ptr<idilia::AsyncRequest> req(new idilia::AsyncRequest);
+      idilia::Arena & arena = req->arena;
+
+      string doc;
+      size_t len = 0;
+      for (size_t i = 0; i < msgs->size(); ++i)
+        len += (*msgs)[i].text.length() + 32;
+      doc.reserve(len);
+      for (size_t i = 0; i < msgs->size(); ++i)
+      {
+        doc += messageMarker(i);
+        escapeHtml(doc, (*msgs)[i].text);
+        doc += "</div>\n";
+      }
+
+      string_view text(arena.strdup(doc.data(), doc.length()), doc.length());
+      idilia::RequestParms parms(arena);
+      parms["text"] = text;
+      parms["textMime"] = "text/html; charset=UTF-8";
+      parms["tag.repeatPolicy"] = opts_.repeatPolicy;
+      parms["tag.markup"] = opts_.markup;
+      idilia::preparePost(*req, hostname, "/1/text/tag.json",
+          "application/x-www-form-urlencoded; charset=UTF-8", idilia::convertToQueryParms(arena, parms), text);
+
+      req->onDone = [this, msgs](idilia::AsyncRequest & req, CURLcode cc, long httpCode) {
+        try
+        {
+          complete(req, cc, httpCode, *msgs);
+        }
+        catch (...)
+        {
+          finished();
+          throw;
+        }
+        finished();
+      };
+
+      // Counted before it is submitted: the destructor waits for the requests submitted
+      {
+        lock_guard<mutex> lock(mutex_);
+        ++outstanding_;
+        counted = true;
+      }
+      transport_.submit(move(req));
+    }
+    catch (const exception & e)
+    {
+      string error = string("Could not send: ") + e.what();
+      for (size_t i = 0; i < msgs->size(); ++i)
+        deliver(TagResult{(*msgs)[i].id, false, error, string(), vector<Tag>()});
+      if (counted)
+        finished();
+    }
+  }
+
+  void finished()
+  {
+    lock_guard<mutex> lock(mutex_);
+    if (--outstanding_ == 0)
+      doneCond_.notify_all();
+  }
+
+  // Deliver the results of a batch. Called on the thread of the transport.
+  void complete(idilia::AsyncRequest & req, CURLcode cc, long httpCode, vector<Message> & batch)
+  {
+    string_view json = idilia::flatten(req.arena, req.response.view());
+    string tagged;
+    if (httpCode != 200 || !idilia::jsonStringMember(json, "text", tagged))
+    {
+      string error = cc != CURLE_OK ? curl_easy_strerror(cc) : to_string(httpCode) + ' ' + string(json);
+      for (size_t i = 0; i < batch.size(); ++i)
+        deliver(TagResult{batch[i].id, false, error, string(), vector<Tag>()});
+      return;
+    }
+
+    // Split the tagged document at the blocks of the messages
+    vector<size_t> markers(batch.size() + 1);
+    for (size_t i = 0, pos = 0; i < batch.size(); ++i)
+    {
+      pos = tagged.find(messageMarker(i), pos);
+      if (pos == string::npos && batch.size() == 1)
+      {
+        // The markup was not preserved: the document is the message
+        deliver(makeResult(batch[0].id, move(tagged)));
+        return;
+      }
+      if (pos == string::npos)
+      {
+        // The markup was not preserved. Fall back to one request per message.
+        for (size_t j = 0; j < batch.size(); ++j)
+          send(vector<Message>(1, move(batch[j])));
+        return;
+      }
+      markers[i] = pos;
+    }
+    markers[batch.size()] = tagged.length();
+
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+      size_t st = markers[i] + messageMarker(i).length();
+      size_t en = markers[i + 1];
+      size_t close = tagged.rfind("</div>", en);
+      if (close != string::npos && close >= st)
+        en = close;
+      deliver(makeResult(batch[i].id, tagged.substr(st, en - st)));
+    }
+  }
+
+  // The tagged words are the elements with a data-idl-fsk attribute
+  static TagResult makeResult(uint64_t id, string tagged)
+  {
+    static const string attr = "data-idl-fsk=\"";
+    TagResult res{id, true, string(), move(tagged), vector<Tag>()};
+    const string & t = res.taggedText;
+    for (size_t pos = t.find(attr); pos != string::npos; pos = t.find(attr, pos))
+    {
+      pos += attr.length();
+      size_t fskEnd = t.find('"', pos);
+      size_t textSt = fskEnd == string::npos ? fskEnd : t.find('>', fskEnd);
+      if (textSt == string::npos)
+        break;
+      ++textSt;
+      size_t textEn = t.find('<', textSt);
+      if (textEn == string::npos)
+        textEn = t.length();
+      res.tags.push_back(Tag{t.substr(textSt, textEn - textSt), t.substr(pos, fskEnd - pos)});
+      pos = textEn;
+    }
+    return res;
+  }
+
+  void deliver(const TagResult & res)
+  {
+    try
+    {
+      onResult_(res);
+    }
+    catch (const exception & e)
+    {
+      cerr << "Result callback failed for message " << res.id << ": " << e.what() << endl;
+    }
+  }
+
+  static const char * const hostname;
+
+  Options opts_;
+  ResultFn onResult_;
+
+  mutex mutex_;
+  condition_variable cond_;       // signals the timer of a new batch or stop
+  condition_variable doneCond_;   // signals that no batch is outstanding
+  bool stop_;                     // protected by mutex_
+  vector<Message> pending_;       // protected by mutex_
+  size_t bytes_;                  // protected by mutex_
+  chrono::steady_clock::time_point oldest_; // protected by mutex_
+  size_t outstanding_;            // protected by mutex_
+  thread timer_;
+
+  idilia::AsyncTransport transport_; // declared last: stopped before the members used by its callbacks are destroyed
+};
+
+const char * const TagStreamClient::hostname = "api.idilia.com";
+
+
+int main(int argc, char **argv)
+{
+  // Set your environment variables to the keys obtained from https://www.idilia.com/developer/my-projects
+
+  // Global initializations to do only once
+  curl_global_init(CURL_GLOBAL_ALL);
+
+  // Set the locale to English to get RFC2616 HTTP dates with English day names.
+  if (!setlocale(LC_ALL, "en_US.utf8"))
+    throw runtime_error("Could not set the locale to english. Needed for authentication.");
+
+  vector<string> samples = {
+    "RT @blecklerr: just saw a southern tide decal on a nissan with dark tint and the biggest shiniest rims. #theyreconfused #WhatsGoingOnHere",
+    "Kanye West got to do most of the talking during Taylor Swift's acceptance speech",
+    "Rolling Stone has learned that backstage, Swift's mother approached West",
+  };
+
+  atomic<size_t> numOk(0), numFailed(0), numTags(0);
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  {
+    TagStreamClient client([&](const TagResult & res) {
+      if (!res.ok)
+      {
+        ++numFailed;
+        cerr << "Message " << res.id << " failed: " << res.error << endl;
+        return;
+      }
+      ++numOk;
+      numTags += res.tags.size();
+      cout << "Message " << res.id << ":";
+      for (size_t i = 0; i < res.tags.size(); ++i)
+        cout << " [" << res.tags[i].surface << " " << res.tags[i].fsk << "]";
+      cout << endl;
+    });
+
+    uint64_t id = 0;
+    if (!isatty(0))
+    {
+      for (string line; getline(cin, line); )
+        if (!line.empty())
+          client.submit(id++, line);
+    }
+    for (size_t i = 0; id == 0 && i < samples.size(); ++i)
+      client.submit(i, samples[i]);
+  }
+  double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  cerr << "Tagged " << numOk << " messages (" << numTags << " tags), " << numFailed << " failed in "
+       << secs << "s" << endl;
+
+  // Global cleanup done once
+  curl_global_cleanup();
+  return numFailed == 0 ? 0 : 1;
+}
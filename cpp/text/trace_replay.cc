@@ -0,0 +1,425 @@
+/*
+ * Example program replaying a trace recorded from real traffic to benchmark the client offline.
+ *
+ * The requests of the trace are sent again with the AsyncTransport at their
+ * original pace, or scaled, to a local server answering with the recorded
+ * responses after the recorded service times. The report compares the replay
+ * throughput and latency with those of the recording, so that an incident
+ * captured in production becomes a reproducible performance test.
+ *
+ * The client's work is replayed with the requests: the requests to the known
+ * endpoints are rebuilt from their recorded parameters with EndpointRequest
+ * (encoding and signing), and their responses are decoded (multipart parts, senses
+ * of the semdocs, paraphrases, JSON). The time spent in this work is reported.
+ * The requests to other endpoints, and all of them with --raw, are sent as the
+ * recorded bytes and only their transfer is measured.
+ *
+ * Traces are recorded with the --record option of disambiguate_coro or by any
+ * client observing its AsyncTransport with a TraceWriter.
+ *
+ * The rebuilt requests are signed with the keys of the environment variables
+ * IDILIA_ACCESS_KEY and IDILIA_PRIVATE_KEY. Placeholder keys are used when they
+ * are not set: the local server does not check the signatures.
+ *
+ * Requires the RPMs: mhash-devel curl-devel libxml2-devel zlib-devel
+ *
+ * Compile with:
+ *   g++ -std=c++17 -pthread -o trace_replay -I /usr/include/libxml2 -lxml2 -lmhash -lcurl -lz trace_replay.cc
+ *
+ * Run with:
+ *   ./trace_replay --trace=/tmp/idilia.trace [--rate=<x>] [--delay=<x>] [--server=<host:port>] [--max-sim-req=<n>] [--raw]
+ * where --rate scales the pace of the requests (2: twice as fast, 0: all at once),
+ * --delay scales the recorded service times (0: respond at once),
+ * --server replays against another server instead of the local one,
+ * and --raw sends the recorded requests as-is and does not decode the responses.
+ */
+
+#include "../common/endpoints.h"
+#include "../common/http.h"
+#include "../common/json.h"
+#include "../common/paraphrases.h"
+#include "../common/replay_server.h"
+#include "../common/senses.h"
+#include "../common/trace.h"
+#include "../common/transport.h"
+#include "../common/xml.h"
+
+#include <libxml/parser.h>
+
+#include <curl/curl.h>
+
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+typedef chrono::steady_clock Clock;
+
+
+// Latency percentiles of a set of samples in microseconds
+static string latencyReport(vector<uint32_t> us)
+{
+  if (us.empty())
+    return "no samples";
+  sort(us.begin(), us.end());
+  auto pct = [&us](double p) { return us[min(us.size() - 1, size_t(p * us.size()))] / 1000.0; };
+  stringstream ss;
+  ss << "p50 " << pct(0.50) << "ms, p90 " << pct(0.90) << "ms, p99 " << pct(0.99) << "ms, max " << us.back() / 1000.0 << "ms";
+  return ss.str();
+}
+
+
+// The endpoints whose requests are rebuilt by the client
+enum ClientEndpoint { rawEndpoint, disambiguateXml, matchJson, paraphraseXml, kbQueryJson };
+
+
+// A recorded request decoded to the parameters of its endpoint
+struct ClientRequest
+{
+  ClientEndpoint endpoint = rawEndpoint;
+  vector<pair<string, string> > parms; // names and values
+  string_view text;                    // the text parameter, to locate the senses
+};
+
+
+// Whether the parameters are all parameters of E
+template <class E>
+static bool hasParms(const vector<pair<string, string> > & parms)
+{
+  idilia::EndpointRequest<E> request;
+  for (size_t i = 0; i < parms.size(); ++i)
+    if (!request.set(parms[i].first, parms[i].second))
+      return false;
+  return true;
+}
+
+
+// Decode a recorded request to the parameters of its endpoint. Left raw when the
+// endpoint is not known or the body is not made of its url-encoded parameters.
+static void decodeRequest(const idilia::TraceRecord & rec, ClientRequest & out)
+{
+  string_view body(rec.body);
+  for (size_t st = 0, en; st < body.length(); st = en + 1)
+  {
+    en = min(body.find('&', st), body.length());
+    size_t eq = body.find('=', st);
+    if (eq >= en)
+      return;
+    out.parms.push_back(make_pair(idilia::urlDecode(body.substr(st, eq - st)), idilia::urlDecode(body.substr(eq + 1, en - eq - 1))));
+  }
+  for (size_t i = 0; i < out.parms.size(); ++i)
+    if (out.parms[i].first == "text")
+      out.text = out.parms[i].second;
+
+  string_view path = idilia::ReplayServer::pathOf(rec.url);
+  if (path == idilia::DisambiguateXml::resource && hasParms<idilia::DisambiguateXml>(out.parms))
+    out.endpoint = disambiguateXml;
+  else if (path == idilia::MatchJson::resource && hasParms<idilia::MatchJson>(out.parms))
+    out.endpoint = matchJson;
+  else if (path == idilia::ParaphraseXml::resource && hasParms<idilia::ParaphraseXml>(out.parms))
+    out.endpoint = paraphraseXml;
+  else if (path == idilia::KbQueryJson::resource && hasParms<idilia::KbQueryJson>(out.parms))
+    out.endpoint = kbQueryJson;
+}
+
+
+// Build the request as the client does: encoded, signed, with the shared headers
+template <class E>
+static void buildRequest(const ClientRequest & cr, idilia::AsyncRequest & req)
+{
+  idilia::EndpointRequest<E> request;
+  for (size_t i = 0; i < cr.parms.size(); ++i)
+    request.set(cr.parms[i].first, cr.parms[i].second);
+  req.body = request.encode(req.arena);
+  req.headers = request.headers(req.arena);
+  curl_easy_setopt(req.curl, CURLOPT_URL, E::url.data());
+  curl_easy_setopt(req.curl, CURLOPT_ACCEPT_ENCODING, "");
+}
+
+
+// Send the recorded bytes
+static void copyRequest(const idilia::TraceRecord & rec, idilia::AsyncRequest & req)
+{
+  for (size_t st = 0, en; st < rec.headers.length(); st = en + 1)
+  {
+    en = rec.headers.find('\n', st);
+    req.headers = idilia::arenaSlistAppend(req.arena, req.headers, {string_view(rec.headers).substr(st, en - st)});
+  }
+  req.body = rec.body;
+  curl_easy_setopt(req.curl, CURLOPT_URL, rec.url.c_str());
+}
+
+
+// Whether the client decodes the documents of a content type
+static bool isDocument(string_view contentType)
+{
+  return contentType.find("xml") != string_view::npos || contentType.find("json") != string_view::npos;
+}
+
+
+// Decode a document of a response as the client would. Returns false if it could not be decoded.
+static bool decodeDocument(const ClientRequest & cr, idilia::Arena & arena, string_view contentType,
+    const idilia::RopeView & content, idilia::SenseKeyDictionary & dict)
+{
+  if (contentType.find("xml") != string_view::npos)
+  {
+    idilia::XmlArenaScope xmlScope(arena);
+    xmlDocPtr doc = idilia::readXmlDoc(content);
+    if (!doc)
+      return false;
+    if (cr.endpoint == paraphraseXml)
+    {
+      idilia::Paraphrases paraphrases;
+      idilia::decodeParaphrases(doc, paraphrases);
+    }
+    else
+    {
+      idilia::CompactSenses senses;
+      idilia::extractSenses(doc, cr.text, dict, senses);
+    }
+    xmlFreeDoc(doc);
+    return true;
+  }
+  string_view json = idilia::flatten(arena, content);
+  size_t pos = json.find_first_not_of(" \t\r\n");
+  return pos != string_view::npos && idilia::jsonSkipValue(json, pos);
+}
+
+
+// Outcome of the replayed requests. Updated on the transport's thread.
+struct ReplayStats
+{
+  mutex m;
+  condition_variable cv;
+  size_t numOutstanding = 0;
+  size_t numFailed = 0;     // not performed or with another status than recorded
+  size_t numMismatched = 0; // response differing from the recording
+  size_t numParts = 0;      // parts of the multipart responses
+  size_t numDecoded = 0;    // documents decoded by the client
+  size_t numUndecoded = 0;  // documents the client could not decode
+  uint64_t bytesSent = 0;
+  uint64_t bytesReceived = 0;
+  Clock::duration decodeTime = Clock::duration::zero();
+  vector<uint32_t> latencies;
+};
+
+
+int main(int argc, char **argv)
+{
+  string traceFile;
+  string server;            // host:port of the server replaying the responses. Local one when empty.
+  double rate = 1.0;        // scale of the pace of the requests
+  double delay = 1.0;       // scale of the recorded service times
+  unsigned maxSimReq = 100; // Number of simultaneous requests
+  bool raw = false;         // send the recorded bytes instead of rebuilding the requests
+  for (int i = 1; i < argc; ++i)
+  {
+    string arg(argv[i]);
+    if (arg.compare(0, 8, "--trace=") == 0)
+      traceFile = arg.substr(8);
+    else if (arg.compare(0, 9, "--server=") == 0)
+      server = arg.substr(9);
+    else if (arg.compare(0, 7, "--rate=") == 0)
+      rate = atof(arg.c_str() + 7);
+    else if (arg.compare(0, 8, "--delay=") == 0)
+      delay = atof(arg.c_str() + 8);
+    else if (arg.compare(0, 14, "--max-sim-req=") == 0)
+      maxSimReq = max(1, atoi(arg.c_str() + 14));
+    else if (arg == "--raw")
+      raw = true;
+    else
+    {
+      cerr << "Usage: " << argv[0] << " --trace=<file> [--rate=<x>] [--delay=<x>] [--server=<host:port>] [--max-sim-req=<n>] [--raw]" << endl;
+      return 1;
+    }
+  }
+  if (traceFile.empty())
+    throw runtime_error("You must provide the trace using --trace");
+
+  // Load the trace. The requests that failed when recorded are not replayed.
+  vector<idilia::TraceRecord> records;
+  {
+    idilia::TraceReader reader(traceFile);
+    for (idilia::TraceRecord rec; reader.next(rec); )
+      if (rec.httpCode)
+        records.push_back(move(rec));
+  }
+  if (records.empty())
+    throw runtime_error("No request to replay in " + traceFile);
+
+  // The records are written as the requests complete: replay them in the order they were sent
+  stable_sort(records.begin(), records.end(),
+      [](const idilia::TraceRecord & a, const idilia::TraceRecord & b) { return a.startUs < b.startUs; });
+
+  vector<uint32_t> recordedLatencies;
+  uint64_t recordedEndUs = 0;
+  for (size_t i = 0; i < records.size(); ++i)
+  {
+    recordedLatencies.push_back(records[i].latencyUs);
+    recordedEndUs = max(recordedEndUs, records[i].startUs + records[i].latencyUs);
+  }
+  double recordedSpan = (recordedEndUs - records.front().startUs) / 1e6;
+  cout << "Recorded: " << records.size() << " requests in " << recordedSpan << "s ("
+       << records.size() / recordedSpan << " req/s), latency " << latencyReport(recordedLatencies) << endl;
+
+  // The parameters of the requests to rebuild
+  vector<ClientRequest> clientRequests(records.size());
+  size_t numRebuilt = 0;
+  for (size_t i = 0; !raw && i < records.size(); ++i)
+  {
+    decodeRequest(records[i], clientRequests[i]);
+    numRebuilt += clientRequests[i].endpoint != rawEndpoint;
+  }
+
+  // The rebuilt requests are signed. The local server does not check the signatures.
+  setenv("IDILIA_ACCESS_KEY", "replay", 0);
+  setenv("IDILIA_PRIVATE_KEY", "replay", 0);
+
+  // Global initializations to do only once
+  curl_global_init(CURL_GLOBAL_ALL);
+  idilia::installXmlArenaHooks();
+  LIBXML_TEST_VERSION;
+
+  // Set the locale to English to get RFC2616 HTTP dates with English day names.
+  if (numRebuilt && !setlocale(LC_ALL, "en_US.utf8"))
+    throw runtime_error("Could not set the locale to english. Needed for authentication.");
+
+  unique_ptr<idilia::ReplayServer> local;
+  if (server.empty())
+  {
+    local.reset(new idilia::ReplayServer(records, delay));
+    server = "127.0.0.1:" + to_string(local->port());
+  }
+  string connectTo = "::" + server; // any host and port of the recorded urls
+
+  ReplayStats stats;
+  idilia::SenseKeyDictionary dict; // used on the transport's thread
+  Clock::duration buildTime = Clock::duration::zero();
+  Clock::time_point start = Clock::now();
+  {
+    idilia::AsyncTransport transport(maxSimReq);
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+      const idilia::TraceRecord & rec = records[i];
+      const ClientRequest & cr = clientRequests[i];
+
+      // Send at the recorded time, scaled. Latency is measured from then, not from when
+      // the request could be sent, so that a slow client does not hide its own delays.
+      Clock::time_point due = start;
+      if (rate > 0)
+        due += chrono::microseconds(uint64_t((rec.startUs - records.front().startUs) / rate));
+      this_thread::sleep_until(due);
+
+      Clock::time_point buildStart = Clock::now();
+      unique_ptr<idilia::AsyncRequest> req(new idilia::AsyncRequest);
+      switch (cr.endpoint)
+      {
+      case disambiguateXml: buildRequest<idilia::DisambiguateXml>(cr, *req); break;
+      case matchJson:       buildRequest<idilia::MatchJson>(cr, *req); break;
+      case paraphraseXml:   buildRequest<idilia::ParaphraseXml>(cr, *req); break;
+      case kbQueryJson:     buildRequest<idilia::KbQueryJson>(cr, *req); break;
+      case rawEndpoint:     copyRequest(rec, *req); break;
+      }
+      curl_slist * connectToList = idilia::arenaSlistAppend(req->arena, 0, {connectTo});
+      curl_easy_setopt(req->curl, CURLOPT_CONNECT_TO, connectToList);
+      curl_easy_setopt(req->curl, CURLOPT_PROXY, "");
+      curl_easy_setopt(req->curl, CURLOPT_POSTFIELDSIZE, (long)req->body.length());
+      curl_easy_setopt(req->curl, CURLOPT_POSTFIELDS, req->body.data());
+      curl_easy_setopt(req->curl, CURLOPT_HTTPHEADER, req->headers);
+      req->response.setup(req->curl);
+      buildTime += Clock::now() - buildStart;
+
+      req->onDone = [&stats, &rec, &cr, &dict, due](idilia::AsyncRequest & r, CURLcode cc, long httpCode) {
+        Clock::time_point now = Clock::now();
+        uint32_t latency = chrono::duration_cast<chrono::microseconds>(now - due).count();
+
+        // Decode the response as the client would. Multipart responses are split in any case.
+        size_t numParts = 0, numDecoded = 0, numUndecoded = 0;
+        if (httpCode != 0)
+        {
+          const char * ct = 0;
+          curl_easy_getinfo(r.curl, CURLINFO_CONTENT_TYPE, &ct);
+          string_view contentType = ct ? ct : "";
+          if (contentType.compare(0, 10, "multipart/") == 0)
+          {
+            idilia::MultipartHttpResponse response(r.arena);
+            if (response.parse(r.response.view()))
+              numParts = response.parts.size();
+            for (size_t i = 0; cr.endpoint != rawEndpoint && i < response.parts.size(); ++i)
+            {
+              auto h = response.parts[i].headers.find("Content-Type");
+              string_view partType = h == response.parts[i].headers.end() ? string_view() : h->second;
+              if (!isDocument(partType))
+                continue;
+              bool ok = decodeDocument(cr, r.arena, partType, response.parts[i].body, dict);
+              numDecoded += ok;
+              numUndecoded += !ok;
+            }
+          }
+          else if (cr.endpoint != rawEndpoint && httpCode == 200 && isDocument(contentType))
+          {
+            bool ok = decodeDocument(cr, r.arena, contentType, r.response.view(), dict);
+            numDecoded += ok;
+            numUndecoded += !ok;
+          }
+        }
+        bool same = r.response.length() == rec.response.length() && r.response.str() == rec.response;
+
+        lock_guard<mutex> lock(stats.m);
+        stats.latencies.push_back(latency);
+        stats.decodeTime += Clock::now() - now;
+        stats.numFailed += cc != CURLE_OK || httpCode != (long)rec.httpCode;
+        stats.numMismatched += httpCode != 0 && !same;
+        stats.numParts += numParts;
+        stats.numDecoded += numDecoded;
+        stats.numUndecoded += numUndecoded;
+        stats.bytesSent += r.body.length();
+        stats.bytesReceived += r.response.length();
+        if (--stats.numOutstanding == 0)
+          stats.cv.notify_all();
+      };
+
+      {
+        lock_guard<mutex> lock(stats.m);
+        ++stats.numOutstanding;
+      }
+      transport.submit(move(req));
+    }
+
+    unique_lock<mutex> lock(stats.m);
+    stats.cv.wait(lock, [&stats] { return stats.numOutstanding == 0; });
+  }
+  double elapsed = chrono::duration<double>(Clock::now() - start).count();
+
+  cout << "Replayed: " << stats.latencies.size() << " requests in " << elapsed << "s ("
+       << stats.latencies.size() / elapsed << " req/s, "
+       << (stats.bytesSent + stats.bytesReceived) / elapsed / (1 << 20) << " MB/s), latency "
+       << latencyReport(stats.latencies) << endl;
+  if (numRebuilt)
+    cout << "Client: " << numRebuilt << " requests rebuilt in " << chrono::duration<double, milli>(buildTime).count()
+         << "ms, " << stats.numDecoded << " documents decoded in " << chrono::duration<double, milli>(stats.decodeTime).count()
+         << "ms, " << records.size() - numRebuilt << " requests sent as recorded" << endl;
+  if (stats.numParts)
+    cout << "Parsed " << stats.numParts << " parts of multipart responses" << endl;
+  if (stats.numUndecoded)
+    cout << stats.numUndecoded << " documents could not be decoded" << endl;
+  if (stats.numFailed || stats.numMismatched)
+    cout << stats.numFailed << " requests failed, " << stats.numMismatched << " responses differ from the recording" << endl;
+
+  local.reset();
+
+  // Global cleanup done once
+  xmlCleanupParser();
+  curl_global_cleanup();
+  return stats.numFailed || stats.numMismatched ? 2 : 0;
+}